@@ -0,0 +1,134 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Submits small tasks in batches and reports the global allocations and the time per submitted task
+namespace {
+std::atomic<size_t> allocations{ 0 };
+
+void* allocate(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr{ std::malloc(size == 0 ? 1 : size) }) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* allocate_aligned(size_t size, std::align_val_t alignment)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    const size_t align{ static_cast<size_t>(alignment) };
+    if (void* ptr{ std::aligned_alloc(align, ((size + align - 1) / align) * align) }) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+} // namespace
+
+void* operator new(size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new[](size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return allocate_aligned(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return allocate_aligned(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned int n_threads{ argc > 1 ? static_cast<unsigned int>(std::atoi(argv[1])) : 1 };
+    constexpr size_t BATCH_SIZE{ 1000 };
+    constexpr size_t BATCH_COUNT{ 200 };
+    constexpr size_t WARMUP_BATCHES{ 10 };
+
+    ThreadPool thread_pool{ n_threads };
+    std::vector<ThreadPool::Future<size_t>> futures;
+    futures.reserve(BATCH_SIZE);
+    size_t checksum{ 0 };
+    auto run_batch = [&]() {
+        for (size_t i{ 0 }; i < BATCH_SIZE; ++i) {
+            futures.push_back(thread_pool.submit(1, [](size_t value) { return value * 3; }, i));
+        }
+        for (ThreadPool::Future<size_t>& future : futures) {
+            checksum += thread_pool.wait(future);
+        }
+        futures.clear();
+    };
+
+    // fills the task caches, as a long running solver would have
+    for (size_t batch{ 0 }; batch < WARMUP_BATCHES; ++batch) {
+        run_batch();
+    }
+
+    const size_t allocations_before{ allocations.load() };
+    const auto start{ std::chrono::steady_clock::now() };
+    for (size_t batch{ 0 }; batch < BATCH_COUNT; ++batch) {
+        run_batch();
+    }
+    const auto elapsed{ std::chrono::steady_clock::now() - start };
+    const size_t task_count{ BATCH_SIZE * BATCH_COUNT };
+    const double task_allocations{ static_cast<double>(allocations.load() - allocations_before) / task_count };
+    const double task_ns{ std::chrono::duration<double, std::nano>(elapsed).count() / task_count };
+
+    std::printf("%u threads, %zu tasks in batches of %zu\n", n_threads, task_count, BATCH_SIZE);
+    std::printf("%.3f allocations/task, %.0f ns/task (checksum %zu)\n", task_allocations, task_ns, checksum);
+    return 0;
+}
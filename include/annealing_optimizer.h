@@ -1,33 +1,66 @@
 #pragma once
+#include "clock_cache.h"
 #include "logger.h"
+#include "thread_pool.h"
 #include "thread_rng.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 #include <functional>
-#include <unordered_map>
+#include <optional>
+#include <utility>
+#include <vector>
 
 template<typename Solution, class SolutionHash = std::hash<Solution>>
 class AnnealingOptimizer
 {
 public:
     using NeighborFunc = std::function<Solution(const Solution&)>;
-    using EnergyFunc = std::function<double(const Solution&)>;
+    // chains running concurrently call it with their own chain_id, 0 for a single chain
+    using EnergyFunc = std::function<double(const Solution&, size_t chain_id)>;
+
+    // Parallel tempering: chain_count chains at temperatures spread geometrically from the initial temperature
+    // up to max_temp_ratio times it, cooled together, swapping solutions between neighbors every exchange_interval
+    struct TemperingSettings
+    {
+        size_t chain_count;
+        double max_temp_ratio;
+        int exchange_interval;
+    };
 
 private:
+    struct Chain
+    {
+        Solution solution;
+        double energy;
+        Solution best_solution;
+        double best_energy;
+    };
+
     const NeighborFunc neighbor_func;
     const EnergyFunc energy_func;
     double T;
     const double cooling_rate;
     const int max_iter;
-    std::unordered_map<Solution, double, SolutionHash> energy_map;
+    ClockCache<Solution, double, SolutionHash> energy_map;
 
 public:
     AnnealingOptimizer(NeighborFunc neighbor_func,
                        EnergyFunc energy_func,
                        double initial_temp,
                        double cooling_rate,
-                       int max_iter);
+                       int max_iter,
+                       size_t memo_capacity);
 
     Solution optimize(const Solution& initial_solution);
+    Solution optimize(const Solution& initial_solution, ThreadPool& thread_pool, const TemperingSettings& settings);
+
+private:
+    double get_energy(const Solution& solution, size_t chain_id);
+    void step(Chain& chain, size_t chain_id, double temp);
+    static const Chain& get_best_chain(const std::vector<Chain>& chains);
+    void log_memo_stats() const;
 };
 
 template<typename Solution, class SolutionHash>
@@ -35,53 +68,139 @@ AnnealingOptimizer<Solution, SolutionHash>::AnnealingOptimizer(NeighborFunc neig
                                                                EnergyFunc energy_func,
                                                                double initial_temp,
                                                                double cooling_rate,
-                                                               int max_iter)
+                                                               int max_iter,
+                                                               size_t memo_capacity)
     : energy_func(energy_func)
     , neighbor_func(neighbor_func)
     , T(initial_temp)
     , cooling_rate(cooling_rate)
     , max_iter(max_iter)
+    , energy_map(memo_capacity)
 {
 }
 
 template<typename Solution, class SolutionHash>
 Solution AnnealingOptimizer<Solution, SolutionHash>::optimize(const Solution& initial_solution)
 {
-    struct SolutionEnergy
-    {
-        Solution solution;
-        double energy;
+    const double energy{ get_energy(initial_solution, 0) };
+    Chain chain{ initial_solution, energy, initial_solution, energy };
 
-        SolutionEnergy(AnnealingOptimizer<Solution, SolutionHash>& ao, const Solution& solution)
-            : solution(solution)
-            , energy(ao.energy_map.contains(solution) ? ao.energy_map[solution] : ao.energy_func(solution))
-        {
-            ao.energy_map[solution] = energy;
-        }
-    };
+    for (int i = 0; i < max_iter; ++i) {
+        step(chain, 0, T);
 
-    SolutionEnergy current{ *this, initial_solution };
-    energy_map[current.solution] = current.energy;
+        T *= cooling_rate;
 
-    SolutionEnergy best{ current };
+        Logger::info(
+            "Temperature: {:.2f}, Current Energy: {:.2f}, Best Energy: {:.2f}", T, chain.energy, chain.best_energy);
+    }
+    log_memo_stats();
+    return chain.best_solution;
+}
 
-    for (int i = 0; i < max_iter; ++i) {
-        const SolutionEnergy neighbor{ *this, neighbor_func(current.solution) };
+template<typename Solution, class SolutionHash>
+Solution AnnealingOptimizer<Solution, SolutionHash>::optimize(const Solution& initial_solution,
+                                                              ThreadPool& thread_pool,
+                                                              const TemperingSettings& settings)
+{
+    if (settings.chain_count <= 1) {
+        return optimize(initial_solution);
+    }
 
-        const double delta{ neighbor.energy - current.energy };
+    std::vector<double> chain_temps(settings.chain_count);
+    std::vector<Chain> chains;
+    chains.reserve(settings.chain_count);
+    for (size_t chain_id{ 0 }; chain_id < settings.chain_count; ++chain_id) {
+        const double position{ static_cast<double>(chain_id) / static_cast<double>(settings.chain_count - 1) };
+        chain_temps[chain_id] = T * std::pow(settings.max_temp_ratio, position);
+        const double energy{ get_energy(initial_solution, chain_id) };
+        chains.push_back({ initial_solution, energy, initial_solution, energy });
+    }
 
-        if (delta < 0 || ThreadRng::uniform_real(0.0, 1.0) < exp(-delta / T)) {
-            current = neighbor;
+    for (int round_begin{ 0 }, round{ 0 }; round_begin < max_iter; round_begin += settings.exchange_interval, ++round) {
+        const int round_steps{ std::min(settings.exchange_interval, max_iter - round_begin) };
+        thread_pool.parallel_for(0, chains.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t chain_id{ begin }; chain_id < end; ++chain_id) {
+                double temp{ chain_temps[chain_id] };
+                for (int i{ 0 }; i < round_steps; ++i) {
+                    step(chains[chain_id], chain_id, temp);
+                    temp *= cooling_rate;
+                }
+            }
+        });
+        for (double& temp : chain_temps) {
+            temp *= std::pow(cooling_rate, round_steps);
+        }
 
-            if (current.energy < best.energy) {
-                best = current;
+        // alternating even and odd neighbor pairs lets a solution travel the whole ladder
+        size_t exchanges{ 0 };
+        for (size_t cold{ static_cast<size_t>(round % 2) }; cold + 1 < chains.size(); cold += 2) {
+            Chain& cold_chain{ chains[cold] };
+            Chain& hot_chain{ chains[cold + 1] };
+            const double log_p{ (cold_chain.energy - hot_chain.energy) *
+                                ((1.0 / chain_temps[cold]) - (1.0 / chain_temps[cold + 1])) };
+            if (log_p >= 0 || ThreadRng::uniform_real(0.0, 1.0) < exp(log_p)) {
+                std::swap(cold_chain.solution, hot_chain.solution);
+                std::swap(cold_chain.energy, hot_chain.energy);
+                exchanges++;
             }
         }
 
-        T *= cooling_rate;
+        Logger::info("Temperature: {:.2f}, Coldest Energy: {:.2f}, Exchanges: {}, Best Energy: {:.2f}",
+                     chain_temps.front(),
+                     chains.front().energy,
+                     exchanges,
+                     get_best_chain(chains).best_energy);
+    }
+    log_memo_stats();
+    return get_best_chain(chains).best_solution;
+}
 
-        Logger::info(
-            "Temperature: {:.2f}, Current Energy: {:.2f}, Best Energy: {:.2f}", T, current.energy, best.energy);
+template<typename Solution, class SolutionHash>
+double AnnealingOptimizer<Solution, SolutionHash>::get_energy(const Solution& solution, size_t chain_id)
+{
+    if (const std::optional<double> energy{ energy_map.find(solution) }) {
+        return *energy;
     }
-    return best.solution;
-}
\ No newline at end of file
+    const double energy{ energy_func(solution, chain_id) };
+    energy_map.insert_or_assign(solution, energy);
+    return energy;
+}
+
+template<typename Solution, class SolutionHash>
+const typename AnnealingOptimizer<Solution, SolutionHash>::Chain& AnnealingOptimizer<Solution, SolutionHash>::
+    get_best_chain(const std::vector<Chain>& chains)
+{
+    return *std::min_element(
+        chains.cbegin(), chains.cend(), [](const Chain& a, const Chain& b) { return a.best_energy < b.best_energy; });
+}
+
+template<typename Solution, class SolutionHash>
+void AnnealingOptimizer<Solution, SolutionHash>::log_memo_stats() const
+{
+    const auto stats{ energy_map.get_stats() };
+    const size_t lookups{ stats.hits + stats.misses };
+    Logger::info("Energy memo: {} hits, {} misses ({:.1f}% hit rate), {} evictions",
+                 stats.hits,
+                 stats.misses,
+                 lookups > 0 ? 100.0 * static_cast<double>(stats.hits) / static_cast<double>(lookups) : 0.0,
+                 stats.evictions);
+}
+
+template<typename Solution, class SolutionHash>
+void AnnealingOptimizer<Solution, SolutionHash>::step(Chain& chain, size_t chain_id, double temp)
+{
+    Solution neighbor{ neighbor_func(chain.solution) };
+    const double neighbor_energy{ get_energy(neighbor, chain_id) };
+
+    const double delta{ neighbor_energy - chain.energy };
+
+    if (delta < 0 || ThreadRng::uniform_real(0.0, 1.0) < exp(-delta / temp)) {
+        chain.solution = std::move(neighbor);
+        chain.energy = neighbor_energy;
+
+        if (chain.energy < chain.best_energy) {
+            chain.best_solution = chain.solution;
+            chain.best_energy = chain.energy;
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "array2d.h"
+#include "footprint_cache.h"
+#include "thread_pool.h"
+
+#include <cstdint>
+#include <vector>
+
+// Keeps the MSE delta of every chord up to date by rescoring only the chords crossing the pixels of a drawn string
+class ChordGainTracker
+{
+public:
+    using pixel_t = FootprintCache::pixel_t;
+    using chord_id_t = FootprintCache::chord_id_t;
+
+private:
+    const FootprintCache& footprint_cache;
+    const Array2d<pixel_t>& target;
+    std::vector<int64_t> gains;
+    std::vector<int64_t> gain_deltas; // gain change per intensity at the pixel being drawn
+
+public:
+    ChordGainTracker(const FootprintCache& footprint_cache,
+                     const Array2d<pixel_t>& target,
+                     const Array2d<pixel_t>& current,
+                     ThreadPool& thread_pool);
+    [[nodiscard]] int64_t get_gain(chord_id_t chord_id) const;
+    void draw(chord_id_t chord_id, Array2d<pixel_t>& current);
+};
@@ -0,0 +1,125 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Bounded hash map for memoization, safe to share between threads. Keys are split into independently locked shards.
+// A full shard evicts with CLOCK: a hand sweeps the entries, sparing and clearing those used since its last pass
+template<typename Key, typename Value, class Hash = std::hash<Key>>
+class ClockCache
+{
+public:
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+    };
+
+private:
+    static constexpr size_t SHARD_COUNT{ 16 };
+
+    struct Entry
+    {
+        Value value;
+        bool referenced;
+    };
+
+    using Map = std::unordered_map<Key, Entry, Hash>;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        Map map;
+        std::vector<typename Map::value_type*> ring; // entries in clock order, nodes of map do not move
+        size_t hand{ 0 };
+    };
+
+    const size_t shard_capacity;
+    std::array<Shard, SHARD_COUNT> shards;
+    std::atomic<size_t> hits;
+    std::atomic<size_t> misses;
+    std::atomic<size_t> evictions;
+
+public:
+    ClockCache(size_t capacity);
+    [[nodiscard]] std::optional<Value> find(const Key& key);
+    void insert_or_assign(const Key& key, const Value& value);
+    [[nodiscard]] Stats get_stats() const;
+
+private:
+    [[nodiscard]] Shard& get_shard(size_t hash);
+};
+
+template<typename Key, typename Value, class Hash>
+ClockCache<Key, Value, Hash>::ClockCache(size_t capacity)
+    : shard_capacity{ std::max<size_t>((capacity + SHARD_COUNT - 1) / SHARD_COUNT, 1) }
+    , hits{ 0 }
+    , misses{ 0 }
+    , evictions{ 0 }
+{
+    for (Shard& shard : shards) {
+        shard.map.reserve(shard_capacity);
+        shard.ring.reserve(shard_capacity);
+    }
+}
+
+template<typename Key, typename Value, class Hash>
+std::optional<Value> ClockCache<Key, Value, Hash>::find(const Key& key)
+{
+    Shard& shard{ get_shard(Hash{}(key)) };
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    const auto it{ shard.map.find(key) };
+    if (it == shard.map.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    it->second.referenced = true;
+    return it->second.value;
+}
+
+template<typename Key, typename Value, class Hash>
+void ClockCache<Key, Value, Hash>::insert_or_assign(const Key& key, const Value& value)
+{
+    Shard& shard{ get_shard(Hash{}(key)) };
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    if (const auto it{ shard.map.find(key) }; it != shard.map.end()) {
+        it->second = { value, true };
+        return;
+    }
+
+    if (shard.ring.size() < shard_capacity) {
+        shard.ring.push_back(&*shard.map.emplace(key, Entry{ value, false }).first);
+        return;
+    }
+    while (shard.ring[shard.hand]->second.referenced) {
+        shard.ring[shard.hand]->second.referenced = false;
+        shard.hand = (shard.hand + 1) % shard_capacity;
+    }
+    shard.map.erase(shard.map.find(shard.ring[shard.hand]->first));
+    shard.ring[shard.hand] = &*shard.map.emplace(key, Entry{ value, false }).first;
+    shard.hand = (shard.hand + 1) % shard_capacity;
+    evictions.fetch_add(1, std::memory_order_relaxed);
+}
+
+template<typename Key, typename Value, class Hash>
+typename ClockCache<Key, Value, Hash>::Stats ClockCache<Key, Value, Hash>::get_stats() const
+{
+    return { hits.load(std::memory_order_relaxed),
+             misses.load(std::memory_order_relaxed),
+             evictions.load(std::memory_order_relaxed) };
+}
+
+template<typename Key, typename Value, class Hash>
+typename ClockCache<Key, Value, Hash>::Shard& ClockCache<Key, Value, Hash>::get_shard(size_t hash)
+{
+    // the map buckets by the low bits, so pick the shard from the high ones
+    return shards[((hash >> 32) ^ (hash >> 48)) % SHARD_COUNT];
+}
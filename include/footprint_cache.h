@@ -0,0 +1,120 @@
+#pragma once
+#include "string_line.h"
+#include "thread_pool.h"
+#include "vec.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+// Rasterized pixels of every chord between two nails, shared read-only by all color solvers
+class FootprintCache
+{
+public:
+    using pixel_t = uint8_t;
+    using chord_id_t = uint32_t;
+
+    struct Footprint
+    {
+        std::span<const uint32_t> pixels; // x + y * w
+        std::span<const pixel_t> intensities;
+    };
+
+    struct PixelChords
+    {
+        std::span<const chord_id_t> chord_ids;
+        std::span<const pixel_t> intensities;
+    };
+
+    // pixels of a footprint grouped by COARSE_CELL_SIZE x COARSE_CELL_SIZE cell
+    struct CoarseCell
+    {
+        uint32_t cell; // x / COARSE_CELL_SIZE + y / COARSE_CELL_SIZE * coarse_w
+        uint32_t pixel_count;
+        uint32_t intensity_sum;
+    };
+
+    static constexpr size_t COARSE_CELL_SIZE{ 8 };
+
+private:
+    struct Range
+    {
+        size_t begin;
+        size_t size;
+    };
+
+    static constexpr uint32_t EMPTY_CELL_SLOT{ std::numeric_limits<uint32_t>::max() };
+
+    struct CellGrid
+    {
+        uint32_t w;
+        std::vector<uint32_t> column_cells; // x / factor
+        std::vector<uint32_t> row_cells;    // y / factor * coarse w
+        std::vector<uint32_t> cell_slots;   // position of a cell in the cells being aggregated
+    };
+
+    struct NailFootprints
+    {
+        std::vector<Range> ranges; // by chord id relative to the first chord from the nail
+        std::vector<uint32_t> pixels;
+        std::vector<pixel_t> intensities;
+    };
+
+    const size_t w, h;
+    const nail_id_t nail_count;
+    const double string_radius;
+    double string_function_lut_scale;
+    std::vector<pixel_t> string_function_lut;
+    std::vector<Range> ranges;
+    std::vector<uint32_t> pixels;
+    std::vector<pixel_t> intensities;
+    double chord_overlap;
+    std::vector<size_t> pixel_offsets;
+    std::vector<chord_id_t> pixel_chord_ids;
+    std::vector<pixel_t> pixel_intensities;
+    std::vector<Range> coarse_ranges;
+    std::vector<CoarseCell> coarse_cells;
+
+public:
+    FootprintCache(size_t w,
+                   size_t h,
+                   const std::vector<Vec2<double>>& nail_positions,
+                   double nail_radius,
+                   double string_radius,
+                   ThreadPool& thread_pool);
+    // footprints of full averaged over factor x factor pixel blocks
+    FootprintCache(const FootprintCache& full, size_t factor, ThreadPool& thread_pool);
+
+    [[nodiscard]] chord_id_t get_chord_id(nail_id_t start_nail_id,
+                                          StringLine::Wrap start_wrap,
+                                          nail_id_t end_nail_id,
+                                          StringLine::Wrap end_wrap) const;
+    [[nodiscard]] chord_id_t get_chord_id(const StringLine& string_line) const;
+    [[nodiscard]] chord_id_t get_stored_chord_id(chord_id_t chord_id) const;
+    [[nodiscard]] size_t get_chord_count() const;
+    [[nodiscard]] Footprint get(chord_id_t chord_id) const;
+    [[nodiscard]] Footprint get(const StringLine& string_line) const;
+    [[nodiscard]] pixel_t string_function(double d) const;
+    [[nodiscard]] pixel_t get_max_intensity() const;
+    [[nodiscard]] double get_chord_overlap() const;
+    void build_pixel_index();
+    [[nodiscard]] bool has_pixel_index() const;
+    [[nodiscard]] PixelChords get_pixel_chords(uint32_t pixel) const;
+    void build_coarse_index(ThreadPool& thread_pool);
+    [[nodiscard]] bool has_coarse_index() const;
+    [[nodiscard]] std::span<const CoarseCell> get_coarse_cells(chord_id_t chord_id) const;
+    [[nodiscard]] size_t get_coarse_w() const;
+    [[nodiscard]] size_t get_coarse_h() const;
+    [[nodiscard]] size_t get_w() const;
+    [[nodiscard]] size_t get_h() const;
+
+private:
+    [[nodiscard]] pixel_t compute_string_function(double d) const;
+    void add_nail_footprints(nail_id_t start_nail_id, const NailFootprints& nail_footprints);
+    void link_mirrored_ranges();
+    void compute_chord_overlap();
+    [[nodiscard]] static CellGrid make_cell_grid(size_t w, size_t h, size_t factor);
+    static void aggregate_cells(const Footprint& footprint, CellGrid& grid, std::vector<CoarseCell>& cells);
+};
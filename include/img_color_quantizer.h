@@ -1,31 +1,107 @@
 #pragma once
 #include "color.h"
 #include "img.h"
+#include "planar_img.h"
 #include "thread_pool.h"
 
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <optional>
-#include <unordered_map>
+#include <random>
+#include <utility>
 #include <vector>
 
 class ImageColorQuantizer
 {
-    std::unordered_map<Color, uint32_t> colors;
+    // partial histograms built at once, at most one per thread
+    static constexpr size_t HISTOGRAM_MEMORY_BUDGET{ size_t{ 256 } << 20 };
+    // a k-means run is abandoned once its inertia is this many times the best of the finished runs
+    static constexpr double ABANDON_INERTIA_RATIO{ 1.25 };
+    // colors a k-means pass hands to a thread at once, fixed so the sums do not depend on the thread count
+    static constexpr size_t K_MEANS_GRAIN{ 16384 };
+    // k-means restarts run as tasks of this priority and their passes above it. A restart waiting on its pass only
+    // helps with pass chunks, so restarts never nest and at most one per thread is in flight
+    static constexpr int K_MEANS_RESTART_PRIORITY{ 1 };
+    static constexpr int K_MEANS_PRIORITY{ 2 };
+    // unique colors from which KMeansMode::AUTO clusters in mini-batches
+    static constexpr size_t MINI_BATCH_MIN_COLORS{ size_t{ 1 } << 18 };
+    static constexpr size_t MINI_BATCH_SIZE{ 4096 };
+    static constexpr size_t MINI_BATCH_ITERATIONS{ 100 };
+    static constexpr size_t MINI_BATCH_SEED_SAMPLE{ 3 * MINI_BATCH_SIZE }; // colors k-means++ picks the centroids from
+
+    // unique colors with their pixel counts, an array per channel so distance loops vectorize
+    struct WeightedColors
+    {
+        std::array<std::vector<float>, Color::CHANNELS> channels;
+        std::vector<uint32_t> counts;
+
+        void push_back(const Color& color, uint32_t count);
+        void append(const WeightedColors& other);
+        [[nodiscard]] size_t size() const;
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] Color get_color(size_t i) const;
+    };
+
+    // Vose's alias method, draws a color with probability proportional to its count in constant time
+    struct ColorSampler
+    {
+        std::vector<double> probabilities; // of keeping the drawn slot rather than taking its alias
+        std::vector<uint32_t> aliases;
+
+        explicit ColorSampler(const std::vector<uint32_t>& counts);
+        size_t operator()(std::mt19937& rng) const;
+    };
+
+    WeightedColors colors;
     const std::vector<Color> const_centroids;
     ThreadPool& thread_pool;
 
 public:
+    enum class PaletteMethod : uint8_t
+    {
+        K_MEANS,
+        MEDIAN_CUT,         // Wu's quantizer, a single deterministic pass over a coarse histogram
+        MEDIAN_CUT_K_MEANS, // a single k-means run starting from the median cut palette
+    };
+
+    enum class KMeansMode : uint8_t
+    {
+        AUTO,       // mini-batches from MINI_BATCH_MIN_COLORS unique colors
+        FULL,       // every iteration assigns every color
+        MINI_BATCH, // every iteration samples a batch of colors by their counts
+    };
+
+    // Counts the colors of an 8 bit image in a dense histogram of opaque colors indexed by their packed RGB.
+    // histogram_bits below 8 bins every channel to its top bits, a bin then stands for the mean color of its pixels
+    ImageColorQuantizer(const PlanarImg& img,
+                        const std::vector<Color>& const_centroids,
+                        ThreadPool& thread_pool,
+                        const std::optional<Array2d<uint8_t>>& mask = std::nullopt,
+                        uint32_t histogram_bits = 8);
     ImageColorQuantizer(const Img& img,
                         const std::vector<Color>& const_centroids,
                         ThreadPool& thread_pool,
-                        const std::optional<Array2d<uint8_t>>& mask = std::nullopt);
+                        const std::optional<Array2d<uint8_t>>& mask = std::nullopt,
+                        uint32_t histogram_bits = 8);
 
     [[nodiscard]] std::vector<Color> get_pallete(uint32_t n_colors,
                                                  uint32_t n_iter,
                                                  double threshold,
-                                                 size_t seed = 0) const;
+                                                 size_t seed = 0,
+                                                 PaletteMethod method = PaletteMethod::K_MEANS,
+                                                 KMeansMode mode = KMeansMode::AUTO) const;
 
 private:
-    std::pair<std::vector<Color>, double> k_means(size_t k, double threshold) const;
-    static Color random_color();
+    // an abandoned run has infinite inertia
+    std::pair<std::vector<Color>, double> k_means(std::vector<Color> centroids,
+                                                  double threshold,
+                                                  std::atomic<double>& best_inertia) const;
+    // runs a fixed number of batches, their moves shrink too fast to stop at a threshold
+    std::pair<std::vector<Color>, double> mini_batch_k_means(size_t k,
+                                                             const ColorSampler& sampler,
+                                                             std::atomic<double>& best_inertia) const;
+    [[nodiscard]] std::vector<Color> median_cut(size_t k) const;
+    // an empty sample seeds from all colors
+    [[nodiscard]] std::vector<Color> seed_centroids(size_t k, const std::vector<size_t>& sample) const;
 };
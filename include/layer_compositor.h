@@ -0,0 +1,69 @@
+#pragma once
+#include "color.h"
+#include "img.h"
+#include "planar_img.h"
+#include "thread_pool.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Squared error between the target and color layers blended over the background in a given order.
+// Keeps the composite error of the last evaluated order and only re-blends pixels covered by layers that moved
+class LayerCompositor
+{
+public:
+    using Order = std::vector<int>;
+
+    // the target and the layers over every pixel, read-only and shared by all compositors of the same layers
+    class Coverage
+    {
+    public:
+        // color premultiplied by alpha, blending premultiplied colors needs no division per layer
+        struct PixelLayer
+        {
+            uint32_t layer;
+            float r, g, b, a;
+        };
+
+    private:
+        std::array<std::vector<float>, Color::CHANNELS> target_channels; // the target converted once, by pixel
+        // layers over pixel p are pixel_layers[pixel_offsets[p], pixel_offsets[p + 1]) in layer order
+        std::vector<size_t> pixel_offsets;
+        std::vector<PixelLayer> pixel_layers;
+        std::vector<std::vector<uint32_t>> layer_pixels; // pixels where the layer is not transparent
+
+    public:
+        Coverage(const PlanarImg& target_img, const std::vector<const Img*>& layers, ThreadPool& thread_pool);
+        [[nodiscard]] size_t get_pixel_count() const;
+        [[nodiscard]] Color get_target(uint32_t p) const;
+        [[nodiscard]] size_t get_layer_count() const;
+        [[nodiscard]] size_t get_pixel_offset(uint32_t p) const;
+        [[nodiscard]] size_t get_entry_count() const;
+        [[nodiscard]] const PixelLayer& get_entry(size_t entry) const;
+        [[nodiscard]] const std::vector<uint32_t>& get_layer_pixels(size_t layer) const;
+    };
+
+private:
+    const Color background_color;
+    const Coverage& coverage;
+    ThreadPool& thread_pool;
+    // coverage entries of every pixel, kept sorted by the current order
+    std::vector<uint32_t> pixel_entries;
+    Order order;
+    std::vector<int> layer_ranks;
+    std::vector<double> pixel_errors;
+    double energy;
+    std::vector<uint32_t> pixel_marks;
+    uint32_t mark;
+    std::vector<uint32_t> dirty_pixels;
+
+public:
+    LayerCompositor(Color background_color, const Coverage& coverage, ThreadPool& thread_pool);
+    [[nodiscard]] double evaluate(const Order& new_order);
+
+private:
+    [[nodiscard]] double pixel_error(uint32_t p);
+    double evaluate_all();
+};
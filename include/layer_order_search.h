@@ -0,0 +1,83 @@
+#pragma once
+#include "color.h"
+#include "img.h"
+#include "planar_img.h"
+#include "thread_pool.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Finds the layer order with the least squared error exactly, by branch and bound over orders built from the top down.
+// Searches layers averaged over factor x factor pixel blocks. The layers not placed yet are bounded per channel by
+// their composites in the darkest and brightest orders, which the placed layers above only scale and offset
+class LayerOrderSearch
+{
+public:
+    using Order = std::vector<int>;
+
+    static constexpr size_t MAX_LAYERS{ 16 }; // layers over a pixel are kept as a 16 bit mask
+
+private:
+    using Rgb = std::array<float, 3>;
+
+    // difference with a composite of premultiplied color c is (offset - c) / alpha, the alpha being order independent
+    struct Pixel
+    {
+        Rgb offset;
+        float weight; // pixels in the block / alpha^2
+    };
+
+    // premultiplied composite of the placed layers and the transmittance below them
+    struct Stack
+    {
+        Rgb color;
+        float transmittance;
+    };
+
+    struct Branch
+    {
+        double energy;
+        Order order;
+        size_t visited;
+    };
+
+    const size_t layer_count;
+    size_t pixel_count;
+    Rgb background;
+    // premultiplied color and alpha of pixel p of layer l at l * pixel_count + p
+    std::vector<std::array<float, 4>> layer_pixels;
+    std::vector<Pixel> pixels;
+    std::vector<uint16_t> pixel_coverage; // mask of the layers not transparent over a pixel
+    std::vector<Rgb> layer_color_min;
+    std::vector<Rgb> layer_color_max;
+    std::array<std::vector<int>, 3> darkest_layers;   // by least color of a channel
+    std::array<std::vector<int>, 3> brightest_layers; // by greatest color of a channel
+    ThreadPool& thread_pool;
+    std::atomic<double> best_energy;
+    size_t visited;
+
+public:
+    LayerOrderSearch(const PlanarImg& target_img,
+                     Color background_color,
+                     const std::vector<const Img*>& layers,
+                     size_t factor,
+                     ThreadPool& thread_pool);
+    // bottom layer first, like the rest of the solver
+    [[nodiscard]] Order solve();
+    [[nodiscard]] size_t get_visited_nodes() const;
+    [[nodiscard]] double get_energy() const;
+
+private:
+    void search(Branch& branch, std::vector<std::vector<Stack>>& stacks, Order& placed, uint32_t used);
+    [[nodiscard]] double get_bound(const std::vector<Stack>& stack, int layer, uint32_t used) const;
+    [[nodiscard]] float composite(const std::vector<int>& layers,
+                                  const std::vector<Rgb>& colors,
+                                  size_t c,
+                                  size_t p) const;
+    [[nodiscard]] float get_transmittance(const std::vector<int>& layers, size_t p) const;
+    void place(const std::vector<Stack>& stack, int layer, std::vector<Stack>& child) const;
+    void offer_energy(double energy);
+};
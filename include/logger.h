@@ -1,27 +1,73 @@
 #pragma once
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
-#include <mutex>
+#include <format>
 #include <print>
+#include <string>
+#include <utility>
 
+// lowest level compiled in: 0 debug, 1 info, 2 warn, 3 error
+#ifndef LOGGER_MIN_LEVEL
+#if defined(NDEBUG)
+#define LOGGER_MIN_LEVEL 1
+#else
+#define LOGGER_MIN_LEVEL 0
+#endif
+#endif
+
+// Messages are formatted by the logging thread into its own ring buffer and printed by a background thread,
+// so logging never waits for a lock or for the console
 class Logger
 {
-    static std::mutex mtx;
-    static std::chrono::time_point<std::chrono::steady_clock> start_time;
+public:
+    enum class OverflowPolicy : uint8_t
+    {
+        DROP,  // a full ring drops the message, the drops are reported once there is room
+        BLOCK, // a full ring waits for the background thread
+    };
 
+private:
     enum class LogLevel : uint8_t
     {
+        DEBUG,
         INFO,
         WARN,
-        ERROR,
-        DEBUG
+        ERROR
+    };
+
+    static constexpr LogLevel MIN_LEVEL{ static_cast<LogLevel>(LOGGER_MIN_LEVEL) };
+    static constexpr size_t MESSAGE_CAPACITY{ 240 };
+
+    struct Record
+    {
+        uint64_t sequence;
+        int64_t elapsed_ms;
+        LogLevel level;
+        uint16_t length;
+        std::array<char, MESSAGE_CAPACITY> text;
+        std::string long_text; // the whole message when it does not fit in text, allocated only then
     };
 
+    class Ring;
+    class Backend;
+
+    static const std::chrono::time_point<std::chrono::steady_clock> start_time;
+    static std::atomic<OverflowPolicy> overflow_policy;
+
     static constexpr const char* log_level_str(LogLevel level);
 
     template<LogLevel LOG_LEVEL, typename... Args>
     static void log(const std::format_string<Args...> format, Args&&... args);
 
+    // a free record of the calling thread's ring, nullptr when the message is dropped
+    static Record* acquire();
+    static void publish();
+    static void print(const Record& record);
+
 public:
     template<typename... Args>
     static void info(const std::format_string<Args...> format, Args&&... args);
@@ -31,6 +77,8 @@ public:
     static void error(const std::format_string<Args...> format, Args&&... args);
     template<typename... Args>
     static void debug(const std::format_string<Args...> format, Args&&... args);
+
+    static void set_overflow_policy(OverflowPolicy policy);
 };
 
 constexpr const char* Logger::log_level_str(LogLevel level)
@@ -51,21 +99,24 @@ constexpr const char* Logger::log_level_str(LogLevel level)
 template<Logger::LogLevel LOG_LEVEL, typename... Args>
 void Logger::log(const std::format_string<Args...> format, Args&&... args)
 {
-#if defined(NDEBUG)
-    if constexpr (LOG_LEVEL == LogLevel::DEBUG) {
+    if constexpr (LOG_LEVEL < MIN_LEVEL) {
         return;
-    }
-#endif
-    std::lock_guard<std::mutex> lock(mtx);
-
-    const auto now_time{ std::chrono::steady_clock::now() };
-    const auto elapsed_ms{ std::chrono::duration_cast<std::chrono::milliseconds>(now_time - start_time).count() };
-
-    const std::string formatted_msg{ std::format(format, std::forward<Args>(args)...) };
-    if constexpr (LOG_LEVEL == LogLevel::ERROR) {
-        std::println(stderr, log_level_str(LOG_LEVEL), elapsed_ms, formatted_msg);
     } else {
-        std::println(log_level_str(LOG_LEVEL), elapsed_ms, formatted_msg);
+        Record* const record{ acquire() };
+        if (record == nullptr) {
+            return;
+        }
+        const auto now_time{ std::chrono::steady_clock::now() };
+        record->elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now_time - start_time).count();
+        record->level = LOG_LEVEL;
+
+        const auto result{ std::format_to_n(
+            record->text.data(), record->text.size(), format, std::forward<Args>(args)...) };
+        record->length = static_cast<uint16_t>(result.out - record->text.data());
+        if (result.size > static_cast<std::ptrdiff_t>(record->text.size())) {
+            record->long_text = std::vformat(format.get(), std::make_format_args(args...));
+        }
+        publish();
     }
 }
 
@@ -91,4 +142,4 @@ template<typename... Args>
 void Logger::debug(const std::format_string<Args...> format, Args&&... args)
 {
     log<LogLevel::DEBUG>(format, std::forward<Args>(args)...);
-}
\ No newline at end of file
+}
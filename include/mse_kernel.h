@@ -0,0 +1,27 @@
+#pragma once
+#include "footprint_cache.h"
+#include "string_solver.h"
+
+#include <cstdint>
+
+// Sum of squared error changes from drawing a footprint over a residual buffer (see StringSolver::residual_t),
+// and a lower bound on that sum that stays valid however much is drawn over the footprint later.
+// The buffer must have at least one element of padding after the last pixel, the vector paths read 32 bits per pixel.
+struct MseDelta
+{
+    int64_t delta;
+    int64_t lower_bound;
+};
+
+[[nodiscard]] MseDelta footprint_mse_delta(const FootprintCache::Footprint& footprint,
+                                           const StringSolver::residual_t* residual);
+[[nodiscard]] const char* footprint_mse_delta_isa();
+
+[[nodiscard]] MseDelta footprint_mse_delta_scalar(const FootprintCache::Footprint& footprint,
+                                                  const StringSolver::residual_t* residual);
+#if defined(__x86_64__) || defined(__i386__)
+[[nodiscard]] MseDelta footprint_mse_delta_sse41(const FootprintCache::Footprint& footprint,
+                                                 const StringSolver::residual_t* residual);
+[[nodiscard]] MseDelta footprint_mse_delta_avx2(const FootprintCache::Footprint& footprint,
+                                                const StringSolver::residual_t* residual);
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+#include "color.h"
+#include "img.h"
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// An image stored a channel at a time, every channel row starting on its own cache line.
+// Channels are kept as u8 in [0, 255], as f16 bits or as f32, the last two holding the values of Img as they are
+class PlanarImg
+{
+public:
+    enum class Precision : uint8_t
+    {
+        U8,
+        F16,
+        F32,
+    };
+
+    static constexpr size_t ALIGNMENT{ 64 };
+
+private:
+    struct alignas(ALIGNMENT) CacheLine
+    {
+        std::array<std::byte, ALIGNMENT> bytes;
+    };
+
+    size_t w, h;
+    Precision precision;
+    size_t row_lines;             // cache lines of a channel row
+    std::vector<CacheLine> lines; // row y of channel c starts at line (c * h + y) * row_lines
+
+public:
+    PlanarImg(size_t w = 0, size_t h = 1, Precision precision = Precision::F32);
+    PlanarImg(const Img& img, Precision precision);
+    static PlanarImg load(const std::string& path, Precision precision);
+    [[nodiscard]] Img to_img() const;
+
+    [[nodiscard]] size_t get_w() const;
+    [[nodiscard]] size_t get_h() const;
+    [[nodiscard]] size_t size() const;
+    [[nodiscard]] Precision get_precision() const;
+    [[nodiscard]] static size_t get_channel_size(Precision precision);
+
+    // Raw row of a channel: uint8_t for U8, uint16_t f16 bits for F16, float for F32. Rows are padded to whole cache
+    // lines, so vector loads may run past the last pixel
+    template<typename T>
+    [[nodiscard]] T* row(size_t channel, size_t y);
+    template<typename T>
+    [[nodiscard]] const T* row(size_t channel, size_t y) const;
+    // a channel row converted to floats and back, u8 mapped to [0, 1]
+    void load_row(size_t channel, size_t y, float* out) const;
+    void store_row(size_t channel, size_t y, const float* in);
+
+    [[nodiscard]] Color get(size_t x, size_t y) const;
+    void set(size_t x, size_t y, const Color& color);
+
+private:
+    [[nodiscard]] const std::byte* row_bytes(size_t channel, size_t y) const;
+};
+
+template<typename T>
+T* PlanarImg::row(size_t channel, size_t y)
+{
+    return const_cast<T*>(std::as_const(*this).row<T>(channel, y));
+}
+
+template<typename T>
+const T* PlanarImg::row(size_t channel, size_t y) const
+{
+    assert(sizeof(T) == get_channel_size(precision));
+    return reinterpret_cast<const T*>(row_bytes(channel, y));
+}
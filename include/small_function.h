@@ -0,0 +1,170 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<class Signature, size_t Capacity = 64>
+class SmallFunction;
+
+// Move-only callable that keeps callables of up to Capacity bytes inline instead of allocating like std::function
+template<class R, class... Args, size_t Capacity>
+class SmallFunction<R(Args...), Capacity>
+{
+private:
+    struct Ops
+    {
+        R (*invoke)(void* storage, Args&&... args);
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    template<class F>
+    static constexpr bool is_inline{ sizeof(F) <= Capacity && alignof(F) <= alignof(std::max_align_t) &&
+                                     std::is_nothrow_move_constructible_v<F> };
+
+    alignas(std::max_align_t) std::byte storage[Capacity];
+    const Ops* ops;
+
+    template<class F>
+    static constexpr bool is_wrappable{ !std::is_same_v<std::remove_cvref_t<F>, SmallFunction> &&
+                                        std::is_invocable_r_v<R, std::decay_t<F>&, Args...> };
+
+    template<class F>
+    static F& get(void* storage);
+    template<class F>
+    static R invoke(void* storage, Args&&... args);
+    template<class F>
+    static void move(void* from, void* to);
+    template<class F>
+    static void destroy(void* storage);
+    template<class F>
+    static constexpr Ops ops_for{ &invoke<F>, &move<F>, &destroy<F> };
+
+public:
+    SmallFunction();
+    template<class F, class = std::enable_if_t<is_wrappable<F>>>
+    SmallFunction(F&& func);
+    SmallFunction(const SmallFunction&) = delete;
+    SmallFunction& operator=(const SmallFunction&) = delete;
+    SmallFunction(SmallFunction&& other) noexcept;
+    SmallFunction& operator=(SmallFunction&& other) noexcept;
+    ~SmallFunction();
+    R operator()(Args... args);
+    explicit operator bool() const;
+
+private:
+    void reset();
+};
+
+template<class R, class... Args, size_t Capacity>
+template<class F>
+F& SmallFunction<R(Args...), Capacity>::get(void* storage)
+{
+    if constexpr (is_inline<F>) {
+        return *std::launder(static_cast<F*>(storage));
+    } else {
+        return **static_cast<F**>(storage);
+    }
+}
+
+template<class R, class... Args, size_t Capacity>
+template<class F>
+R SmallFunction<R(Args...), Capacity>::invoke(void* storage, Args&&... args)
+{
+    return std::invoke(get<F>(storage), std::forward<Args>(args)...);
+}
+
+template<class R, class... Args, size_t Capacity>
+template<class F>
+void SmallFunction<R(Args...), Capacity>::move(void* from, void* to)
+{
+    if constexpr (is_inline<F>) {
+        ::new (to) F{ std::move(get<F>(from)) };
+        get<F>(from).~F();
+    } else {
+        ::new (to) F*{ *static_cast<F**>(from) };
+    }
+}
+
+template<class R, class... Args, size_t Capacity>
+template<class F>
+void SmallFunction<R(Args...), Capacity>::destroy(void* storage)
+{
+    if constexpr (is_inline<F>) {
+        get<F>(storage).~F();
+    } else {
+        delete *static_cast<F**>(storage);
+    }
+}
+
+template<class R, class... Args, size_t Capacity>
+SmallFunction<R(Args...), Capacity>::SmallFunction()
+    : ops{ nullptr }
+{
+}
+
+template<class R, class... Args, size_t Capacity>
+template<class F, class>
+SmallFunction<R(Args...), Capacity>::SmallFunction(F&& func)
+    : ops{ &ops_for<std::decay_t<F>> }
+{
+    using Stored = std::decay_t<F>;
+    if constexpr (is_inline<Stored>) {
+        ::new (static_cast<void*>(storage)) Stored{ std::forward<F>(func) };
+    } else {
+        ::new (static_cast<void*>(storage)) Stored*{ new Stored{ std::forward<F>(func) } };
+    }
+}
+
+template<class R, class... Args, size_t Capacity>
+SmallFunction<R(Args...), Capacity>::SmallFunction(SmallFunction&& other) noexcept
+    : ops{ other.ops }
+{
+    if (ops) {
+        ops->move(other.storage, storage);
+        other.ops = nullptr;
+    }
+}
+
+template<class R, class... Args, size_t Capacity>
+SmallFunction<R(Args...), Capacity>& SmallFunction<R(Args...), Capacity>::operator=(SmallFunction&& other) noexcept
+{
+    if (this != &other) {
+        reset();
+        ops = other.ops;
+        if (ops) {
+            ops->move(other.storage, storage);
+            other.ops = nullptr;
+        }
+    }
+    return *this;
+}
+
+template<class R, class... Args, size_t Capacity>
+SmallFunction<R(Args...), Capacity>::~SmallFunction()
+{
+    reset();
+}
+
+template<class R, class... Args, size_t Capacity>
+R SmallFunction<R(Args...), Capacity>::operator()(Args... args)
+{
+    return ops->invoke(storage, std::forward<Args>(args)...);
+}
+
+template<class R, class... Args, size_t Capacity>
+SmallFunction<R(Args...), Capacity>::operator bool() const
+{
+    return ops != nullptr;
+}
+
+template<class R, class... Args, size_t Capacity>
+void SmallFunction<R(Args...), Capacity>::reset()
+{
+    if (ops) {
+        ops->destroy(storage);
+        ops = nullptr;
+    }
+}
@@ -1,27 +1,36 @@
 #pragma once
+#include "footprint_cache.h"
 #include "img.h"
+#include "planar_img.h"
+#include "string_color_solver.h"
 #include "string_sequence.h"
 #include "thread_pool.h"
 
 #include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
 
 class StringArtSolver
 {
 private:
-    const Img target_img;
+    const PlanarImg target_img;
     const std::vector<Color> palette;
     const Color background_color;
     const double img_scale;
     const double nail_radius;
     const double string_radius;
+    const StringColorSolver::ScoringMode scoring_mode;
+    const StringColorSolver::PyramidSettings pyramid_settings;
+    const uint32_t rearrange_chains;
     ThreadPool& thread_pool;
     const std::vector<Vec2<double>> nail_positions;
+    std::unique_ptr<FootprintCache> footprint_cache;
+    std::vector<std::unique_ptr<FootprintCache>> pyramid_footprint_caches;
     std::unique_ptr<StringSequence> sequence;
     std::unique_ptr<Img> output_img;
 
-    StringArtSolver(Img&& target_img,
+    StringArtSolver(PlanarImg&& target_img,
                     std::vector<Color>&& palette,
                     Color background_color,
                     double img_diameter_cm,
@@ -29,6 +38,9 @@ private:
                     double nail_diameter_cm,
                     double nail_img_dist_cm,
                     double string_diameter_cm,
+                    StringColorSolver::ScoringMode scoring_mode,
+                    StringColorSolver::PyramidSettings pyramid_settings,
+                    uint32_t rearrange_chains,
                     ThreadPool& thread_pool);
 
 public:
@@ -42,6 +54,11 @@ public:
     [[nodiscard]] double get_nail_radius_px() const;
 
 private:
+    // palettes up to this size are ordered by an exact search instead of annealing, the crossover measured on the
+    // sample image: 9 colors took 0.12-0.15 s exactly against 0.9-1.0 s annealing, 10 colors 0.34-1.1 s against
+    // 0.8-1.4 s
+    static constexpr size_t EXACT_REARRANGE_MAX_COLORS{ 9 };
+
     struct ColorSolverResult
     {
         Color color;
@@ -49,15 +66,16 @@ private:
         std::unique_ptr<Img> img;
     };
 
-    std::vector<ColorSolverResult> solve_colors();
+    std::vector<ColorSolverResult> solve_colors(StringColorSolver::ScoringMode color_scoring_mode);
     void rearrange_colors(std::vector<ColorSolverResult>& color_solver_results);
+    void rearrange_colors_exact(std::vector<ColorSolverResult>& color_solver_results);
     static std::vector<Vec2<double>> make_nail_positions(Vec2<double> center, double radius, uint32_t n);
 };
 
 class StringArtSolver::Builder
 {
 private:
-    Img target_img;
+    PlanarImg target_img;
     std::vector<Color> palette;
     Color background_color;
     double img_diameter_cm;
@@ -65,12 +83,18 @@ private:
     double nail_diameter_cm;
     double nail_img_dist_cm;
     double string_diameter_cm;
+    StringColorSolver::ScoringMode scoring_mode;
+    StringColorSolver::PyramidSettings pyramid_settings;
+    uint32_t rearrange_chains;
     std::optional<std::reference_wrapper<ThreadPool>> thread_pool;
 
 public:
     Builder();
     StringArtSolver build();
+    // kept as F32, so the solver sees the same values
     Builder& set_target_img(Img&& target_img);
+    // kept in the precision it has, U8 takes a quarter of the memory and is exact for 8 bit images
+    Builder& set_target_img(PlanarImg&& target_img);
     Builder& set_palette(std::vector<Color>&& palette);
     Builder& set_background_color(Color background_color);
     Builder& set_img_diameter_cm(double diameter);
@@ -78,5 +102,11 @@ public:
     Builder& set_nail_diameter_cm(double diameter);
     Builder& set_nail_img_dist_cm(double distance);
     Builder& set_string_diameter_cm(double diameter);
+    Builder& set_scoring_mode(StringColorSolver::ScoringMode mode);
+    Builder& set_pyramid_levels(uint32_t levels);
+    Builder& set_pyramid_shortlist_size(uint32_t size);
+    Builder& set_pyramid_coarse_steps(uint32_t steps);
+    // more than one chain rearranges colors with parallel tempering, one chain per pool thread uses every core
+    Builder& set_rearrange_chains(uint32_t chains);
     Builder& set_thread_pool(ThreadPool& thread_pool);
 };
\ No newline at end of file
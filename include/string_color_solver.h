@@ -1,36 +1,90 @@
 #pragma once
 #include "array2d.h"
+#include "chord_gain_tracker.h"
+#include "footprint_cache.h"
 #include "img.h"
+#include "planar_img.h"
 #include "string_line.h"
 #include "string_solver.h"
 #include "thread_pool.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <optional>
+#include <utility>
 #include <vector>
 
 class StringColorSolver
 {
+public:
+    enum class ScoringMode : uint8_t
+    {
+        AUTO,
+        FULL,
+        INCREMENTAL
+    };
+
+    struct PyramidSettings
+    {
+        uint32_t levels;         // 1 scores every candidate at full resolution
+        uint32_t shortlist_size; // candidates confirmed at full resolution
+        uint32_t coarse_steps;   // leading steps that draw the best coarse candidate without confirming a shortlist
+    };
+
 private:
+    struct PyramidLevel
+    {
+        const FootprintCache& footprint_cache;
+        const size_t factor;
+        Array2d<StringSolver::pixel_t> target;
+        Array2d<StringSolver::pixel_t> current;
+        Array2d<StringSolver::residual_t> residual;
+    };
+
     Array2d<StringSolver::pixel_t> target;
     Array2d<StringSolver::pixel_t> current;
+    Array2d<StringSolver::residual_t> residual;
     const std::vector<Vec2<double>>& nail_positions;
     const double nail_radius;
     const double string_radius;
     const Color color;
+    const FootprintCache& footprint_cache;
+    const ScoringMode scoring_mode;
+    const PyramidSettings pyramid_settings;
+    std::vector<PyramidLevel> pyramid; // downsampled by 2, 4, ...
     ThreadPool& thread_pool;
     std::unique_ptr<std::vector<StringLine>> sequence;
+    std::unique_ptr<ChordGainTracker> gain_tracker;
+    std::vector<double> chord_bounds; // by stored chord id, lower bounds on the mse delta from previous scans
+    std::vector<int32_t> cell_residual_max; // by coarse cell, largest positive target - current
+    size_t pruned_candidates;
+    size_t scanned_candidates;
 
 public:
-    StringColorSolver(const Img& full_img,
+    StringColorSolver(const PlanarImg& full_img,
                       const Color& background_color,
                       const std::vector<Vec2<double>>& nail_positions,
                       const double nail_radius,
                       const double string_radius,
                       const Color& color,
+                      const FootprintCache& footprint_cache,
+                      ScoringMode scoring_mode,
+                      const std::vector<std::unique_ptr<FootprintCache>>& pyramid_footprint_caches,
+                      PyramidSettings pyramid_settings,
                       ThreadPool& thread_pool);
     void solve();
     double solve_step();
+    double solve_step_incremental();
     std::unique_ptr<std::vector<StringLine>> get_sequence();
     std::unique_ptr<Img> get_img() const;
+
+private:
+    [[nodiscard]] std::vector<size_t> shortlist_candidates(nail_id_t last_nail_id, StringLine::Wrap last_wrap);
+    void update_pyramid(const FootprintCache::Footprint& footprint);
+    void update_cell_residual_max(const FootprintCache::Footprint& footprint);
+    [[nodiscard]] double get_coarse_bound(FootprintCache::chord_id_t chord_id) const;
+    [[nodiscard]] std::pair<nail_id_t, StringLine::Wrap> get_candidate_end(nail_id_t last_nail_id,
+                                                                          size_t candidate) const;
+    StringSolver make_candidate_solver(nail_id_t last_nail_id, StringLine::Wrap last_wrap, size_t candidate);
 };
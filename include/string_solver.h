@@ -1,29 +1,41 @@
 #pragma once
 #include "array2d.h"
+#include "footprint_cache.h"
 #include "string_line.h"
 
+#include <cstdint>
 #include <optional>
 
 class StringSolver
 {
 public:
-    using pixel_t = uint8_t;
+    using pixel_t = FootprintCache::pixel_t;
+    // (target - current) << RESIDUAL_HEADROOM_BITS | min(max - current, RESIDUAL_HEADROOM_MAX)
+    using residual_t = int16_t;
+    static constexpr double min_string_length{ 100.0 }; // TODO: make this a parameter
+    static constexpr int RESIDUAL_HEADROOM_BITS{ 7 };
+    static constexpr int RESIDUAL_HEADROOM_MAX{ (1 << RESIDUAL_HEADROOM_BITS) - 1 };
 
 private:
     const Array2d<pixel_t>& target;
     Array2d<pixel_t>& current;
-    const double string_radius;
+    Array2d<residual_t>& residual;
+    const FootprintCache::Footprint footprint;
     const StringLine string_line;
     std::optional<double> mse_delta;
+    std::optional<double> mse_delta_bound;
 
 public:
     StringSolver(const Array2d<pixel_t>& target,
                  Array2d<pixel_t>& current,
-                 const double string_radius,
+                 Array2d<residual_t>& residual,
+                 const FootprintCache::Footprint footprint,
                  const StringLine&& string_line);
     void solve();
     void draw();
-    [[nodiscard]] pixel_t string_function(double d) const;
+    [[nodiscard]] static residual_t make_residual(pixel_t target, pixel_t current);
     [[nodiscard]] StringLine get_string_line() const;
     [[nodiscard]] double get_mse_delta() const;
-};
\ No newline at end of file
+    // no later solve of this string, after any number of draws, returns a delta below this
+    [[nodiscard]] double get_mse_delta_bound() const;
+};
@@ -1,19 +1,35 @@
 #pragma once
-#include "priority_queue.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
 #include <functional>
-#include <future>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
+#include <type_traits>
+#include <variant>
 #include <vector>
 
+#include "small_function.h"
+
 class ThreadPool
 {
 private:
+    // Tasks are allocated from fixed size blocks recycled through per-thread caches,
+    // so submitting does not go through the global allocator once the caches are warm
     class AbstractTask
     {
         int priority;
 
     public:
+        static constexpr size_t BLOCK_SIZE{ 256 };
+
         AbstractTask(int priority);
         AbstractTask(const AbstractTask&) = delete;
         AbstractTask& operator=(const AbstractTask&) = delete;
@@ -22,87 +38,363 @@ private:
         virtual ~AbstractTask() = default;
         [[nodiscard]] int get_priority() const { return priority; }
         virtual void run() = 0;
-        bool operator<(const AbstractTask& other) const;
+        // drops the reference held by the queue
+        virtual void release();
+        static void* operator new(size_t size);
+        static void operator delete(void* p, size_t size);
+    };
+
+    struct TaskRelease
+    {
+        void operator()(AbstractTask* task) const { task->release(); }
     };
+    using TaskPtr = std::unique_ptr<AbstractTask, TaskRelease>;
 
-    template<class R, class... Args>
+    // a task is also the shared state of its future, it is freed once both have released it
+    template<class R>
     class Task : public AbstractTask
     {
-        const std::function<R(Args...)> func;
-        std::promise<R> promise;
-        std::tuple<Args...> args;
+        using Value = std::conditional_t<std::is_void_v<R>, std::monostate, R>;
+
+        SmallFunction<R()> func;
+        std::atomic<bool> ready;
+        std::atomic<unsigned int> references;
+        std::optional<Value> value;
+        std::exception_ptr exception;
+
+    public:
+        template<class F>
+        Task(int priority, F&& func);
+        void run() override;
+        void release() override;
+        [[nodiscard]] bool is_ready() const;
+        void wait() const;
+        R get();
+    };
+
+    // [begin, end) split into chunks that the calling thread and helper tasks claim until none are left
+    class ChunkedJob
+    {
+    public:
+        using ChunkFunc = void (*)(void* context, size_t chunk_id, size_t chunk_begin, size_t chunk_end);
+
+    private:
+        const size_t begin, end, chunk_size, chunk_count;
+        const ChunkFunc func;
+        void* const context;
+        std::atomic<size_t> next_chunk;
+        std::atomic<size_t> remaining_chunks;
+        std::atomic_flag failed;
+        std::exception_ptr exception;
+
+    public:
+        ChunkedJob(size_t begin, size_t end, size_t chunk_size, ChunkFunc func, void* context);
+        void run_chunks();
+        [[nodiscard]] bool is_done() const;
+        void wait_for_progress() const;
+        void rethrow_exception() const;
+        [[nodiscard]] size_t get_chunk_count() const;
+    };
+
+    // outlives the call that created the job if it is only dequeued after the job is done, then claims nothing
+    class ChunkedJobTask : public AbstractTask
+    {
+        const std::shared_ptr<ChunkedJob> job;
 
     public:
-        Task(int priority, std::function<R(Args...)> func, Args&&... args);
+        ChunkedJobTask(int priority, std::shared_ptr<ChunkedJob> job);
         void run() override;
-        std::future<R> get_future();
     };
 
-    PriorityQueue<std::unique_ptr<AbstractTask>,
-                  std::vector<std::unique_ptr<AbstractTask>>,
-                  std::function<bool(const std::unique_ptr<AbstractTask>&, const std::unique_ptr<AbstractTask>&)>>
-        tasks;
-    std::mutex tasks_mutex;
-    std::condition_variable tasks_cv;
+    static constexpr size_t CHUNKS_PER_THREAD{ 4 };
+
+    // Tasks queued on one worker, a deque per priority ordered from the highest priority.
+    // The owner takes its newest task from the back, thieves take the oldest from the front
+    struct Worker
+    {
+        std::mutex mutex;
+        std::map<int, std::deque<TaskPtr>, std::greater<>> queues;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> queued_tasks;
+    std::atomic<size_t> next_worker; // round robin target for tasks submitted from outside the pool
+    std::atomic<unsigned int> sleeping_threads;
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
     std::vector<std::jthread> threads;
 
 public:
+    template<class R>
+    class Future
+    {
+        Task<R>* task;
+
+    public:
+        Future();
+        explicit Future(Task<R>* task);
+        Future(const Future&) = delete;
+        Future& operator=(const Future&) = delete;
+        Future(Future&& other) noexcept;
+        Future& operator=(Future&& other) noexcept;
+        ~Future();
+        [[nodiscard]] bool valid() const;
+        [[nodiscard]] bool is_ready() const;
+        [[nodiscard]] int get_priority() const;
+        void wait() const;
+        // the result can be taken once, a task exception is rethrown here
+        R get();
+    };
+
     ThreadPool(unsigned int n_threads = std::thread::hardware_concurrency());
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
     ThreadPool(ThreadPool&&) = delete;
     ThreadPool& operator=(ThreadPool&&) = delete;
     ~ThreadPool();
-    template<class R, class... Args>
-    std::future<R> submit(int priority, std::function<R(Args...)> func, Args... args);
+    template<class F, class... Args>
+    Future<std::invoke_result_t<F&, Args&...>> submit(int priority, F&& func, Args... args);
+    // future.get() that keeps a worker of this pool running queued tasks until the result is ready,
+    // other threads just block. Only tasks of at least the future's priority are run, so a waiting worker never
+    // nests a task of the lower priority level that is waiting on this work
+    template<class R>
+    R wait(Future<R>& future);
+    // Runs f(chunk_begin, chunk_end) over [begin, end) split into chunks, on the pool and the calling thread.
+    // A non-zero grain is the chunk size, 0 picks one that gives every thread a few chunks.
+    // While waiting for the last chunks the calling worker only runs tasks of at least the given priority
+    template<class F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F&& f, int priority = 1);
+    // Maps every chunk to a value and folds the values with combine in chunk order,
+    // so the result does not depend on which thread ran which chunk
+    template<class T, class Map, class Combine>
+    T parallel_reduce(size_t begin,
+                      size_t end,
+                      size_t grain,
+                      T identity,
+                      Map&& map,
+                      Combine&& combine,
+                      int priority = 1);
     [[nodiscard]] unsigned int get_n_threads() const;
 
 private:
-    void thread_loop(std::stop_token stop_token);
+    [[nodiscard]] size_t get_chunk_size(size_t n, size_t grain) const;
+    void run_chunked(size_t begin,
+                     size_t end,
+                     size_t chunk_size,
+                     ChunkedJob::ChunkFunc func,
+                     void* context,
+                     int priority);
+    template<class F>
+    static void call_chunk(void* context, size_t chunk_id, size_t chunk_begin, size_t chunk_end);
+    void push(TaskPtr task);
+    // the highest priority task of at least min_priority
+    TaskPtr pop(size_t worker_id, int min_priority);
+    TaskPtr steal(size_t thief_id, int min_priority);
+    [[nodiscard]] bool is_worker_thread() const;
+    bool run_pending_task(int min_priority = std::numeric_limits<int>::min());
+    void thread_loop(std::stop_token stop_token, size_t worker_id);
 };
 
 // ThreadPool
-template<class R, class... Args>
-std::future<R> ThreadPool::submit(int priority, std::function<R(Args...)> func, Args... args)
+template<class F, class... Args>
+ThreadPool::Future<std::invoke_result_t<F&, Args&...>> ThreadPool::submit(int priority, F&& func, Args... args)
 {
-    auto t = std::make_unique<Task<R, Args...>>(priority, func, std::forward<Args>(args)...);
-    auto fut = t->get_future();
-    {
-        std::unique_lock<std::mutex> lock(tasks_mutex);
-        tasks.push(std::move(t));
+    using R = std::invoke_result_t<F&, Args&...>;
+    auto* task{ new Task<R>(priority, [func = std::forward<F>(func), ... args = std::move(args)]() mutable -> R {
+        return std::invoke(func, args...);
+    }) };
+    Future<R> future{ task };
+    push(TaskPtr{ task });
+    return future;
+}
+
+template<class R>
+R ThreadPool::wait(Future<R>& future)
+{
+    if (is_worker_thread()) {
+        while (!future.is_ready()) {
+            if (!run_pending_task(future.get_priority())) {
+                // nothing left to help with, so the task is running on another thread
+                future.wait();
+            }
+        }
     }
-    tasks_cv.notify_one();
-    return fut;
+    return future.get();
+}
+
+template<class F>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, F&& f, int priority)
+{
+    auto run_chunk = [&f](size_t, size_t chunk_begin, size_t chunk_end) { f(chunk_begin, chunk_end); };
+    run_chunked(begin, end, get_chunk_size(end - begin, grain), call_chunk<decltype(run_chunk)>, &run_chunk, priority);
+}
+
+template<class T, class Map, class Combine>
+T ThreadPool::parallel_reduce(size_t begin,
+                              size_t end,
+                              size_t grain,
+                              T identity,
+                              Map&& map,
+                              Combine&& combine,
+                              int priority)
+{
+    if (begin >= end) {
+        return identity;
+    }
+    const size_t chunk_size{ get_chunk_size(end - begin, grain) };
+    std::vector<T> results((end - begin + chunk_size - 1) / chunk_size, identity);
+    auto run_chunk = [&map, &results](size_t chunk_id, size_t chunk_begin, size_t chunk_end) {
+        results[chunk_id] = map(chunk_begin, chunk_end);
+    };
+    run_chunked(begin, end, chunk_size, call_chunk<decltype(run_chunk)>, &run_chunk, priority);
+
+    T result{ std::move(identity) };
+    for (T& chunk_result : results) {
+        result = combine(std::move(result), std::move(chunk_result));
+    }
+    return result;
+}
+
+template<class F>
+void ThreadPool::call_chunk(void* context, size_t chunk_id, size_t chunk_begin, size_t chunk_end)
+{
+    (*static_cast<F*>(context))(chunk_id, chunk_begin, chunk_end);
 }
 // ThreadPool
 
 // ThreadPool::Task
-template<class R, class... Args>
-ThreadPool::Task<R, Args...>::Task(int priority, std::function<R(Args...)> func, Args&&... args)
+template<class R>
+template<class F>
+ThreadPool::Task<R>::Task(int priority, F&& func)
     : AbstractTask(priority)
-    , func{ std::move(func) }
-    , args{ std::forward<Args>(args)... }
+    , func{ std::forward<F>(func) }
+    , ready{ false }
+    , references{ 2 }
 {
 }
 
-template<class R, class... Args>
-void ThreadPool::Task<R, Args...>::run()
+template<class R>
+void ThreadPool::Task<R>::run()
 {
     try {
         if constexpr (std::is_void_v<R>) {
-            std::apply(func, args);
-            promise.set_value();
+            func();
+            value.emplace();
         } else {
-            promise.set_value(std::move(std::apply(func, args)));
+            value.emplace(func());
         }
     } catch (...) {
-        promise.set_exception(std::current_exception());
+        exception = std::current_exception();
     }
+    ready.store(true, std::memory_order_release);
+    ready.notify_all();
 }
 
-template<class R, class... Args>
-std::future<R> ThreadPool::Task<R, Args...>::get_future()
+template<class R>
+void ThreadPool::Task<R>::release()
 {
-    return promise.get_future();
+    if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+template<class R>
+bool ThreadPool::Task<R>::is_ready() const
+{
+    return ready.load(std::memory_order_acquire);
+}
+
+template<class R>
+void ThreadPool::Task<R>::wait() const
+{
+    ready.wait(false, std::memory_order_acquire);
+}
+
+template<class R>
+R ThreadPool::Task<R>::get()
+{
+    wait();
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+    if constexpr (!std::is_void_v<R>) {
+        return std::move(*value);
+    }
+}
+// ThreadPool::Task
+
+// ThreadPool::Future
+template<class R>
+ThreadPool::Future<R>::Future()
+    : task{ nullptr }
+{
+}
+
+template<class R>
+ThreadPool::Future<R>::Future(Task<R>* task)
+    : task{ task }
+{
+}
+
+template<class R>
+ThreadPool::Future<R>::Future(Future&& other) noexcept
+    : task{ std::exchange(other.task, nullptr) }
+{
+}
+
+template<class R>
+ThreadPool::Future<R>& ThreadPool::Future<R>::operator=(Future&& other) noexcept
+{
+    if (this != &other) {
+        if (task) {
+            task->release();
+        }
+        task = std::exchange(other.task, nullptr);
+    }
+    return *this;
+}
+
+template<class R>
+ThreadPool::Future<R>::~Future()
+{
+    if (task) {
+        task->release();
+    }
+}
+
+template<class R>
+bool ThreadPool::Future<R>::valid() const
+{
+    return task != nullptr;
+}
+
+template<class R>
+bool ThreadPool::Future<R>::is_ready() const
+{
+    return task->is_ready();
+}
+
+template<class R>
+int ThreadPool::Future<R>::get_priority() const
+{
+    return task->get_priority();
+}
+
+template<class R>
+void ThreadPool::Future<R>::wait() const
+{
+    task->wait();
+}
+
+template<class R>
+R ThreadPool::Future<R>::get()
+{
+    Task<R>* const t{ std::exchange(task, nullptr) };
+    struct Release
+    {
+        Task<R>* task;
+        ~Release() { task->release(); }
+    } release{ t };
+    return t->get();
 }
-// ThreadPool::Task
\ No newline at end of file
+// ThreadPool::Future
@@ -0,0 +1,82 @@
+#include "chord_gain_tracker.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace {
+int64_t pixel_gain(int32_t intensity, int32_t current, int32_t target)
+{
+    const int32_t drawn{ std::min(static_cast<int32_t>(std::numeric_limits<FootprintCache::pixel_t>::max()),
+                                  intensity + current) };
+    return ((drawn - target) * (drawn - target)) - ((current - target) * (current - target));
+}
+}
+
+ChordGainTracker::ChordGainTracker(const FootprintCache& footprint_cache,
+                                   const Array2d<pixel_t>& target,
+                                   const Array2d<pixel_t>& current,
+                                   ThreadPool& thread_pool)
+    : footprint_cache{ footprint_cache }
+    , target{ target }
+    , gains(footprint_cache.get_chord_count(), 0)
+    , gain_deltas(footprint_cache.get_max_intensity() + 1)
+{
+    assert(footprint_cache.has_pixel_index());
+
+    thread_pool.parallel_for(0, footprint_cache.get_chord_count(), 0, [&](size_t begin, size_t end) {
+        for (chord_id_t chord_id{ static_cast<chord_id_t>(begin) }; chord_id < end; ++chord_id) {
+            if (footprint_cache.get_stored_chord_id(chord_id) != chord_id) {
+                continue;
+            }
+            const FootprintCache::Footprint footprint{ footprint_cache.get(chord_id) };
+            int64_t gain{ 0 };
+            for (size_t i{ 0 }; i < footprint.pixels.size(); ++i) {
+                const uint32_t p{ footprint.pixels[i] };
+                gain += pixel_gain(footprint.intensities[i], current.data()[p], target.data()[p]);
+            }
+            gains[chord_id] = gain;
+        }
+    });
+}
+
+int64_t ChordGainTracker::get_gain(chord_id_t chord_id) const
+{
+    return gains[footprint_cache.get_stored_chord_id(chord_id)];
+}
+
+void ChordGainTracker::draw(chord_id_t chord_id, Array2d<pixel_t>& current)
+{
+    const FootprintCache::Footprint footprint{ footprint_cache.get(chord_id) };
+    const int32_t max_intensity{ footprint_cache.get_max_intensity() };
+    for (size_t i{ 0 }; i < footprint.pixels.size(); ++i) {
+        const uint32_t p{ footprint.pixels[i] };
+        const int32_t t{ target.data()[p] };
+        const int32_t old_c{ current.data()[p] };
+        const int32_t new_c{ std::min(static_cast<int32_t>(std::numeric_limits<pixel_t>::max()),
+                                      footprint.intensities[i] + old_c) };
+        if (new_c == old_c) {
+            continue;
+        }
+        current.data()[p] = static_cast<pixel_t>(new_c);
+
+        const FootprintCache::PixelChords pixel_chords{ footprint_cache.get_pixel_chords(p) };
+        // all chords through this pixel share (old, new, target), so their gain changes depend only on intensity,
+        // worth tabulating once the pixel has more chords than intensities
+        if (pixel_chords.chord_ids.size() > static_cast<size_t>(max_intensity)) {
+            for (int32_t s{ 0 }; s <= max_intensity; ++s) {
+                gain_deltas[s] = pixel_gain(s, new_c, t) - pixel_gain(s, old_c, t);
+            }
+            for (size_t j{ 0 }; j < pixel_chords.chord_ids.size(); ++j) {
+                gains[pixel_chords.chord_ids[j]] += gain_deltas[pixel_chords.intensities[j]];
+            }
+            continue;
+        }
+        for (size_t j{ 0 }; j < pixel_chords.chord_ids.size(); ++j) {
+            const int32_t s{ pixel_chords.intensities[j] };
+            gains[pixel_chords.chord_ids[j]] += pixel_gain(s, new_c, t) - pixel_gain(s, old_c, t);
+        }
+    }
+}
@@ -0,0 +1,409 @@
+#include "footprint_cache.h"
+#include "line.h"
+#include "string_line.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+FootprintCache::FootprintCache(size_t w,
+                               size_t h,
+                               const std::vector<Vec2<double>>& nail_positions,
+                               double nail_radius,
+                               double string_radius,
+                               ThreadPool& thread_pool)
+    : w{ w }
+    , h{ h }
+    , nail_count{ static_cast<nail_id_t>(nail_positions.size()) }
+    , string_radius{ string_radius }
+    , string_function_lut_scale{ 1024.0 }
+    , ranges(static_cast<size_t>(nail_count) * nail_count * 4, Range{ 0, 0 })
+    , chord_overlap{ 0.0 }
+{
+    // string_function by |d| quantized to 1/1024 px. It is monotonic in |d|, so a bin whose ends agree is exact;
+    // the few bins straddling an intensity step are marked and computed directly
+    const size_t lut_size{ static_cast<size_t>(std::ceil(std::sqrt(string_radius) * string_function_lut_scale)) + 1 };
+    string_function_lut.resize(lut_size);
+    for (size_t i{ 0 }; i < lut_size; ++i) {
+        const pixel_t lo{ compute_string_function(static_cast<double>(i) / string_function_lut_scale) };
+        const pixel_t hi{ compute_string_function(static_cast<double>(i + 1) / string_function_lut_scale) };
+        string_function_lut[i] = lo == hi ? lo : std::numeric_limits<pixel_t>::max();
+    }
+
+    // a chord and its mirror with the same wraps rasterize to identical pixels, so only one of them is stored
+    auto f = [&](nail_id_t start_nail_id) {
+        NailFootprints result;
+        result.ranges.assign(static_cast<size_t>(nail_count) * 4, Range{ 0, 0 });
+        for (auto start_wrap : { StringLine::Wrap::CLOKWISE, StringLine::Wrap::ANTICLOCKWISE }) {
+            for (nail_id_t end_nail_id{ 0 }; end_nail_id < nail_count; ++end_nail_id) {
+                if (end_nail_id == start_nail_id) {
+                    continue;
+                }
+                for (auto end_wrap : { StringLine::Wrap::CLOKWISE, StringLine::Wrap::ANTICLOCKWISE }) {
+                    if (start_wrap == end_wrap && end_nail_id < start_nail_id) {
+                        continue;
+                    }
+                    const StringLine string_line{ nail_positions, nail_radius,  string_radius, start_nail_id,
+                                                  start_wrap,     end_nail_id, end_wrap };
+                    const size_t begin{ result.pixels.size() };
+                    line(string_line.get_start_pos(),
+                         string_line.get_end_pos(),
+                         string_radius,
+                         [&](int32_t x, int32_t y, double d) {
+                             if (x < 0 || y < 0 || static_cast<size_t>(x) >= w || static_cast<size_t>(y) >= h) {
+                                 return;
+                             }
+                             const pixel_t intensity{ string_function(d) };
+                             if (intensity == 0) {
+                                 return;
+                             }
+                             result.pixels.push_back(static_cast<uint32_t>(x + (y * w)));
+                             result.intensities.push_back(intensity);
+                         });
+                    const chord_id_t local_id{ get_chord_id(0, start_wrap, end_nail_id, end_wrap) };
+                    result.ranges[local_id] = { begin, result.pixels.size() - begin };
+                }
+            }
+        }
+        return result;
+    };
+
+    std::vector<ThreadPool::Future<NailFootprints>> futures;
+    futures.reserve(nail_count);
+    for (nail_id_t start_nail_id{ 0 }; start_nail_id < nail_count; ++start_nail_id) {
+        futures.push_back(thread_pool.submit(1, f, start_nail_id));
+    }
+
+    for (nail_id_t start_nail_id{ 0 }; start_nail_id < nail_count; ++start_nail_id) {
+        add_nail_footprints(start_nail_id, thread_pool.wait(futures[start_nail_id]));
+    }
+    link_mirrored_ranges();
+    compute_chord_overlap();
+}
+
+FootprintCache::FootprintCache(const FootprintCache& full, size_t factor, ThreadPool& thread_pool)
+    : w{ (full.w + factor - 1) / factor }
+    , h{ (full.h + factor - 1) / factor }
+    , nail_count{ full.nail_count }
+    , string_radius{ full.string_radius }
+    , string_function_lut_scale{ full.string_function_lut_scale }
+    , string_function_lut{ full.string_function_lut }
+    , ranges(full.ranges.size(), Range{ 0, 0 })
+    , chord_overlap{ 0.0 }
+{
+    const double block_area{ static_cast<double>(factor * factor) };
+    auto f = [&](nail_id_t start_nail_id) {
+        NailFootprints result;
+        result.ranges.assign(static_cast<size_t>(nail_count) * 4, Range{ 0, 0 });
+        const chord_id_t first_id{
+            get_chord_id(start_nail_id, StringLine::Wrap::CLOKWISE, 0, StringLine::Wrap::CLOKWISE)
+        };
+        CellGrid grid{ make_cell_grid(full.w, full.h, factor) };
+        std::vector<CoarseCell> cells;
+        for (size_t i{ 0 }; i < result.ranges.size(); ++i) {
+            if (get_stored_chord_id(first_id + i) != first_id + i) {
+                continue;
+            }
+            aggregate_cells(full.get(static_cast<chord_id_t>(first_id + i)), grid, cells);
+            const size_t begin{ result.pixels.size() };
+            for (const CoarseCell& cell : cells) {
+                const auto intensity{ static_cast<pixel_t>(std::lround(cell.intensity_sum / block_area)) };
+                if (intensity == 0) {
+                    continue;
+                }
+                result.pixels.push_back(cell.cell);
+                result.intensities.push_back(intensity);
+            }
+            result.ranges[i] = { begin, result.pixels.size() - begin };
+        }
+        return result;
+    };
+
+    std::vector<ThreadPool::Future<NailFootprints>> futures;
+    futures.reserve(nail_count);
+    for (nail_id_t start_nail_id{ 0 }; start_nail_id < nail_count; ++start_nail_id) {
+        futures.push_back(thread_pool.submit(1, f, start_nail_id));
+    }
+
+    for (nail_id_t start_nail_id{ 0 }; start_nail_id < nail_count; ++start_nail_id) {
+        add_nail_footprints(start_nail_id, thread_pool.wait(futures[start_nail_id]));
+    }
+    link_mirrored_ranges();
+    compute_chord_overlap();
+}
+
+void FootprintCache::add_nail_footprints(nail_id_t start_nail_id, const NailFootprints& nail_footprints)
+{
+    const size_t offset{ pixels.size() };
+    const chord_id_t first_id{ get_chord_id(start_nail_id, StringLine::Wrap::CLOKWISE, 0, StringLine::Wrap::CLOKWISE) };
+    for (size_t i{ 0 }; i < nail_footprints.ranges.size(); ++i) {
+        ranges[first_id + i] = { nail_footprints.ranges[i].begin + offset, nail_footprints.ranges[i].size };
+    }
+    pixels.insert(pixels.end(), nail_footprints.pixels.cbegin(), nail_footprints.pixels.cend());
+    intensities.insert(intensities.end(), nail_footprints.intensities.cbegin(), nail_footprints.intensities.cend());
+}
+
+void FootprintCache::link_mirrored_ranges()
+{
+    for (nail_id_t start_nail_id{ 0 }; start_nail_id < nail_count; ++start_nail_id) {
+        for (nail_id_t end_nail_id{ 0 }; end_nail_id < start_nail_id; ++end_nail_id) {
+            for (auto wrap : { StringLine::Wrap::CLOKWISE, StringLine::Wrap::ANTICLOCKWISE }) {
+                ranges[get_chord_id(start_nail_id, wrap, end_nail_id, wrap)] =
+                    ranges[get_chord_id(end_nail_id, wrap, start_nail_id, wrap)];
+            }
+        }
+    }
+}
+
+// expected number of stored chords passing through a pixel of a drawn string
+void FootprintCache::compute_chord_overlap()
+{
+    std::vector<uint32_t> pixel_counts(w * h, 0);
+    for (const uint32_t pixel : pixels) {
+        ++pixel_counts[pixel];
+    }
+    double count_sum{ 0.0 };
+    double count_sq_sum{ 0.0 };
+    for (const uint32_t count : pixel_counts) {
+        count_sum += count;
+        count_sq_sum += static_cast<double>(count) * count;
+    }
+    chord_overlap = count_sum > 0 ? count_sq_sum / count_sum : 0.0;
+}
+
+FootprintCache::chord_id_t FootprintCache::get_chord_id(nail_id_t start_nail_id,
+                                                        StringLine::Wrap start_wrap,
+                                                        nail_id_t end_nail_id,
+                                                        StringLine::Wrap end_wrap) const
+{
+    return ((((start_nail_id * 2) + static_cast<chord_id_t>(start_wrap)) * nail_count + end_nail_id) * 2) +
+           static_cast<chord_id_t>(end_wrap);
+}
+
+FootprintCache::chord_id_t FootprintCache::get_chord_id(const StringLine& string_line) const
+{
+    return get_chord_id(string_line.get_start_nail_id(),
+                        string_line.get_start_wrap(),
+                        string_line.get_end_nail_id(),
+                        string_line.get_end_wrap());
+}
+
+FootprintCache::chord_id_t FootprintCache::get_stored_chord_id(chord_id_t chord_id) const
+{
+    const nail_id_t start_nail_id{ chord_id / (nail_count * 4) };
+    const nail_id_t end_nail_id{ (chord_id / 2) % nail_count };
+    const chord_id_t start_wrap{ (chord_id / (nail_count * 2)) % 2 };
+    const chord_id_t end_wrap{ chord_id % 2 };
+    if (start_wrap == end_wrap && end_nail_id < start_nail_id) {
+        return get_chord_id(end_nail_id,
+                            static_cast<StringLine::Wrap>(end_wrap),
+                            start_nail_id,
+                            static_cast<StringLine::Wrap>(start_wrap));
+    }
+    return chord_id;
+}
+
+size_t FootprintCache::get_chord_count() const
+{
+    return ranges.size();
+}
+
+FootprintCache::Footprint FootprintCache::get(chord_id_t chord_id) const
+{
+    const Range& range{ ranges[chord_id] };
+    return { { pixels.data() + range.begin, range.size }, { intensities.data() + range.begin, range.size } };
+}
+
+FootprintCache::Footprint FootprintCache::get(const StringLine& string_line) const
+{
+    return get(get_chord_id(string_line));
+}
+
+FootprintCache::pixel_t FootprintCache::string_function(double d) const
+{
+    const size_t i{ static_cast<size_t>(std::fabs(d) * string_function_lut_scale) };
+    if (i >= string_function_lut.size()) {
+        return 0;
+    }
+    const pixel_t intensity{ string_function_lut[i] };
+    return intensity != std::numeric_limits<pixel_t>::max() ? intensity : compute_string_function(d);
+}
+
+FootprintCache::pixel_t FootprintCache::get_max_intensity() const
+{
+    return compute_string_function(0.0);
+}
+
+FootprintCache::pixel_t FootprintCache::compute_string_function(double d) const
+{
+    return static_cast<pixel_t>((1.0 - std::fmin(1.0, d * d / string_radius)) * 0.30 *
+                                std::numeric_limits<pixel_t>::max());
+}
+
+size_t FootprintCache::get_w() const
+{
+    return w;
+}
+
+size_t FootprintCache::get_h() const
+{
+    return h;
+}
+
+double FootprintCache::get_chord_overlap() const
+{
+    return chord_overlap;
+}
+
+void FootprintCache::build_pixel_index()
+{
+    if (has_pixel_index()) {
+        return;
+    }
+
+    pixel_offsets.assign((w * h) + 1, 0);
+    for (const uint32_t pixel : pixels) {
+        ++pixel_offsets[pixel + 1];
+    }
+    for (size_t i{ 1 }; i < pixel_offsets.size(); ++i) {
+        pixel_offsets[i] += pixel_offsets[i - 1];
+    }
+
+    pixel_chord_ids.resize(pixels.size());
+    pixel_intensities.resize(pixels.size());
+    std::vector<size_t> cursors(pixel_offsets.cbegin(), pixel_offsets.cend() - 1);
+    for (chord_id_t chord_id{ 0 }; chord_id < ranges.size(); ++chord_id) {
+        if (get_stored_chord_id(chord_id) != chord_id) {
+            continue;
+        }
+        const Range& range{ ranges[chord_id] };
+        for (size_t i{ range.begin }; i < range.begin + range.size; ++i) {
+            const size_t cursor{ cursors[pixels[i]]++ };
+            pixel_chord_ids[cursor] = chord_id;
+            pixel_intensities[cursor] = intensities[i];
+        }
+    }
+}
+
+bool FootprintCache::has_pixel_index() const
+{
+    return !pixel_offsets.empty();
+}
+
+FootprintCache::PixelChords FootprintCache::get_pixel_chords(uint32_t pixel) const
+{
+    const size_t begin{ pixel_offsets[pixel] };
+    const size_t size{ pixel_offsets[pixel + 1] - begin };
+    return { { pixel_chord_ids.data() + begin, size }, { pixel_intensities.data() + begin, size } };
+}
+
+void FootprintCache::build_coarse_index(ThreadPool& thread_pool)
+{
+    if (has_coarse_index()) {
+        return;
+    }
+
+    struct NailCoarseCells
+    {
+        std::vector<Range> ranges;
+        std::vector<CoarseCell> cells;
+    };
+
+    auto f = [&](nail_id_t start_nail_id) {
+        NailCoarseCells result;
+        result.ranges.assign(static_cast<size_t>(nail_count) * 4, Range{ 0, 0 });
+        const chord_id_t first_id{
+            get_chord_id(start_nail_id, StringLine::Wrap::CLOKWISE, 0, StringLine::Wrap::CLOKWISE)
+        };
+        CellGrid grid{ make_cell_grid(w, h, COARSE_CELL_SIZE) };
+        std::vector<CoarseCell> chord_cells;
+        for (size_t i{ 0 }; i < result.ranges.size(); ++i) {
+            if (get_stored_chord_id(first_id + i) != first_id + i) {
+                continue;
+            }
+            aggregate_cells(get(static_cast<chord_id_t>(first_id + i)), grid, chord_cells);
+            const size_t begin{ result.cells.size() };
+            result.cells.insert(result.cells.end(), chord_cells.cbegin(), chord_cells.cend());
+            result.ranges[i] = { begin, chord_cells.size() };
+        }
+        return result;
+    };
+
+    std::vector<ThreadPool::Future<NailCoarseCells>> futures;
+    futures.reserve(nail_count);
+    for (nail_id_t start_nail_id{ 0 }; start_nail_id < nail_count; ++start_nail_id) {
+        futures.push_back(thread_pool.submit(1, f, start_nail_id));
+    }
+
+    coarse_ranges.assign(ranges.size(), Range{ 0, 0 });
+    for (nail_id_t start_nail_id{ 0 }; start_nail_id < nail_count; ++start_nail_id) {
+        NailCoarseCells result{ thread_pool.wait(futures[start_nail_id]) };
+        const size_t offset{ coarse_cells.size() };
+        const chord_id_t first_id{
+            get_chord_id(start_nail_id, StringLine::Wrap::CLOKWISE, 0, StringLine::Wrap::CLOKWISE)
+        };
+        for (size_t i{ 0 }; i < result.ranges.size(); ++i) {
+            coarse_ranges[first_id + i] = { result.ranges[i].begin + offset, result.ranges[i].size };
+        }
+        coarse_cells.insert(coarse_cells.end(), result.cells.cbegin(), result.cells.cend());
+    }
+}
+
+bool FootprintCache::has_coarse_index() const
+{
+    return !coarse_ranges.empty();
+}
+
+std::span<const FootprintCache::CoarseCell> FootprintCache::get_coarse_cells(chord_id_t chord_id) const
+{
+    const Range& range{ coarse_ranges[get_stored_chord_id(chord_id)] };
+    return { coarse_cells.data() + range.begin, range.size };
+}
+
+size_t FootprintCache::get_coarse_w() const
+{
+    return (w + COARSE_CELL_SIZE - 1) / COARSE_CELL_SIZE;
+}
+
+size_t FootprintCache::get_coarse_h() const
+{
+    return (h + COARSE_CELL_SIZE - 1) / COARSE_CELL_SIZE;
+}
+
+FootprintCache::CellGrid FootprintCache::make_cell_grid(size_t w, size_t h, size_t factor)
+{
+    const size_t coarse_w{ (w + factor - 1) / factor };
+    const size_t coarse_h{ (h + factor - 1) / factor };
+    CellGrid grid{ static_cast<uint32_t>(w), {}, {}, std::vector<uint32_t>(coarse_w * coarse_h, EMPTY_CELL_SLOT) };
+    grid.column_cells.reserve(w);
+    for (size_t x{ 0 }; x < w; ++x) {
+        grid.column_cells.push_back(static_cast<uint32_t>(x / factor));
+    }
+    grid.row_cells.reserve(h);
+    for (size_t y{ 0 }; y < h; ++y) {
+        grid.row_cells.push_back(static_cast<uint32_t>(y / factor * coarse_w));
+    }
+    return grid;
+}
+
+// leaves grid.cell_slots all empty again on return
+void FootprintCache::aggregate_cells(const Footprint& footprint, CellGrid& grid, std::vector<CoarseCell>& cells)
+{
+    cells.clear();
+    for (size_t i{ 0 }; i < footprint.pixels.size(); ++i) {
+        const uint32_t y{ footprint.pixels[i] / grid.w };
+        const uint32_t x{ footprint.pixels[i] - (y * grid.w) };
+        const uint32_t cell{ grid.column_cells[x] + grid.row_cells[y] };
+        if (grid.cell_slots[cell] == EMPTY_CELL_SLOT) {
+            grid.cell_slots[cell] = static_cast<uint32_t>(cells.size());
+            cells.push_back({ cell, 0, 0 });
+        }
+        CoarseCell& coarse_cell{ cells[grid.cell_slots[cell]] };
+        ++coarse_cell.pixel_count;
+        coarse_cell.intensity_sum += footprint.intensities[i];
+    }
+    for (const CoarseCell& coarse_cell : cells) {
+        grid.cell_slots[coarse_cell.cell] = EMPTY_CELL_SLOT;
+    }
+}
@@ -6,10 +6,142 @@
 #include "thread_rng.h"
 #include "vec.h"
 
-ImageColorQuantizer::ImageColorQuantizer(const Img& img,
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+
+namespace {
+// 0xAABBGGRR
+uint32_t pack_channel(float value)
+{
+    return static_cast<uint32_t>((std::clamp(value, 0.0f, 1.0f) * 255.0f) + 0.5f);
+}
+
+Color unpack_color(uint32_t packed)
+{
+    return Color{ static_cast<int>(packed & 0xFF),
+                  static_cast<int>((packed >> 8) & 0xFF),
+                  static_cast<int>((packed >> 16) & 0xFF),
+                  static_cast<int>(packed >> 24) };
+}
+
+struct ColorHistogram
+{
+    std::vector<uint32_t> counts;
+    std::vector<std::array<uint64_t, 3>> sums; // channel sums of the pixels in every bin, only when binning
+    // packed colors counted by sorting instead, the translucent ones that are rare enough to be kept apart
+    // or all of them in images too small to fill the dense table
+    std::vector<uint32_t> listed;
+};
+
+// moments of the colors in a box of Wu's quantizer, alpha is averaged along but never cut
+struct Moments
+{
+    double weight;
+    std::array<double, Color::CHANNELS> sums;
+    double square_sum;
+
+    Moments operator+(const Moments& other) const
+    {
+        Moments result{ *this };
+        result.weight += other.weight;
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            result.sums[c] += other.sums[c];
+        }
+        result.square_sum += other.square_sum;
+        return result;
+    }
+
+    Moments operator-(const Moments& other) const
+    {
+        Moments negated{ -other.weight, {}, -other.square_sum };
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            negated.sums[c] = -other.sums[c];
+        }
+        return *this + negated;
+    }
+
+    // squared norm of the sums over the weight, what a box loses of the square sum to its variance
+    [[nodiscard]] double get_mean_square() const
+    {
+        double result{ 0.0 };
+        for (const double sum : sums) {
+            result += sum * sum;
+        }
+        return weight > 0.0 ? result / weight : 0.0;
+    }
+};
+
+// cumulative moments over RGB at 32 levels a channel, with a zero border below, so a box of any size sums in O(1)
+class MomentTable
+{
+public:
+    static constexpr size_t SIDE{ 33 };
+
+    // levels lower exclusive, upper inclusive
+    struct Box
+    {
+        std::array<size_t, 3> lower;
+        std::array<size_t, 3> upper;
+    };
+
+private:
+    std::vector<Moments> moments;
+
+public:
+    MomentTable(const std::array<std::vector<float>, Color::CHANNELS>& channels, const std::vector<uint32_t>& counts)
+        : moments(SIDE * SIDE * SIDE, Moments{ 0.0, { 0.0, 0.0, 0.0, 0.0 }, 0.0 })
+    {
+        auto level = [&channels](size_t c, size_t i) { return (pack_channel(channels[c][i]) >> 3) + 1; };
+        for (size_t i{ 0 }; i < counts.size(); ++i) {
+            const double count{ static_cast<double>(counts[i]) };
+            Moments& m{ at(level(0, i), level(1, i), level(2, i)) };
+            m.weight += count;
+            for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+                const double value{ channels[c][i] };
+                m.sums[c] += count * value;
+                m.square_sum += count * value * value;
+            }
+        }
+        for (size_t r{ 1 }; r < SIDE; ++r) {
+            for (size_t g{ 1 }; g < SIDE; ++g) {
+                for (size_t b{ 1 }; b < SIDE; ++b) {
+                    at(r, g, b) = at(r, g, b) + at(r - 1, g, b) + at(r, g - 1, b) + at(r, g, b - 1) -
+                                  at(r - 1, g - 1, b) - at(r - 1, g, b - 1) - at(r, g - 1, b - 1) +
+                                  at(r - 1, g - 1, b - 1);
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] Moments get(const Box& box) const
+    {
+        const auto& [r0, g0, b0] = box.lower;
+        const auto& [r1, g1, b1] = box.upper;
+        return at(r1, g1, b1) - at(r1, g1, b0) - at(r1, g0, b1) + at(r1, g0, b0) - at(r0, g1, b1) + at(r0, g1, b0) +
+               at(r0, g0, b1) - at(r0, g0, b0);
+    }
+
+private:
+    Moments& at(size_t r, size_t g, size_t b) { return moments[(((r * SIDE) + g) * SIDE) + b]; }
+    [[nodiscard]] const Moments& at(size_t r, size_t g, size_t b) const
+    {
+        return moments[(((r * SIDE) + g) * SIDE) + b];
+    }
+};
+} // namespace
+
+ImageColorQuantizer::ImageColorQuantizer(const PlanarImg& img,
                                          const std::vector<Color>& const_centroids,
                                          ThreadPool& thread_pool,
-                                         const std::optional<Array2d<uint8_t>>& mask)
+                                         const std::optional<Array2d<uint8_t>>& mask,
+                                         uint32_t histogram_bits)
     : const_centroids{ const_centroids }
     , thread_pool{ thread_pool }
 {
@@ -17,41 +149,157 @@ ImageColorQuantizer::ImageColorQuantizer(const Img& img,
         assert(img.get_w() == mask->get_w());
         assert(img.get_h() == mask->get_h());
     }
+    if (histogram_bits == 0 || histogram_bits > 8) {
+        throw std::invalid_argument("histogram bits must be between 1 and 8");
+    }
 
-    const uint32_t n_tasks{ thread_pool.get_n_threads() };
-    const size_t rows_per_task{ img.get_h() / n_tasks > 0 ? img.get_h() / n_tasks : 1 };
+    const uint32_t drop_bits{ 8 - histogram_bits };
+    const bool binned{ drop_bits > 0 };
+    const size_t bin_count{ size_t{ 1 } << (3 * histogram_bits) };
+    auto bin_of = [histogram_bits, drop_bits](uint32_t packed) -> size_t {
+        return (((packed & 0xFF) >> drop_bits) << (2 * histogram_bits)) |
+               (((packed >> 8 & 0xFF) >> drop_bits) << histogram_bits) | ((packed >> 16 & 0xFF) >> drop_bits);
+    };
 
-    std::function<std::unordered_map<Color, size_t>(Img::ConstRegion)> f = [&](Img::ConstRegion region) {
-        std::unordered_map<Color, size_t> task_colors;
-        task_colors.reserve(rows_per_task * img.get_w());
-        std::for_each(region.cbegin(), region.cend(), [&](const auto& color) {
-            if (!mask || (*mask)(color.get_x(), color.get_y())) {
-                task_colors[*color]++;
+    const bool dense{ binned || img.size() * 16 >= bin_count };
+    // a partial histogram pays off once it holds more pixels than bins, as every one of them is merged
+    const size_t table_size{ bin_count * (sizeof(uint32_t) + (binned ? sizeof(std::array<uint64_t, 3>) : 0)) };
+    const size_t chunk_count{ std::max<size_t>(std::min({ size_t{ thread_pool.get_n_threads() },
+                                                          HISTOGRAM_MEMORY_BUDGET / table_size,
+                                                          img.size() / bin_count }),
+                                               1) };
+    std::vector<ColorHistogram> histograms(chunk_count);
+    thread_pool.parallel_for(0, chunk_count, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk{ begin }; chunk < end; ++chunk) {
+            ColorHistogram& histogram{ histograms[chunk] };
+            if (dense) {
+                histogram.counts.assign(bin_count, 0);
+            }
+            if (binned) {
+                histogram.sums.assign(bin_count, { 0, 0, 0 });
+            }
+            const size_t y_start{ chunk * img.get_h() / chunk_count };
+            const size_t y_end{ (chunk + 1) * img.get_h() / chunk_count };
+            // rows of other precisions are packed to 8 bits first, the same rounding as U8 uses
+            std::array<std::vector<uint8_t>, Color::CHANNELS> packed_rows;
+            std::vector<float> values;
+            if (img.get_precision() != PlanarImg::Precision::U8) {
+                for (std::vector<uint8_t>& packed_row : packed_rows) {
+                    packed_row.resize(img.get_w());
+                }
+                values.resize(img.get_w());
+            }
+            for (size_t y{ y_start }; y < y_end; ++y) {
+                std::array<const uint8_t*, Color::CHANNELS> rows;
+                for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+                    if (img.get_precision() == PlanarImg::Precision::U8) {
+                        rows[c] = img.row<uint8_t>(c, y);
+                        continue;
+                    }
+                    img.load_row(c, y, values.data());
+                    std::transform(values.cbegin(), values.cend(), packed_rows[c].begin(), pack_channel);
+                    rows[c] = packed_rows[c].data();
+                }
+                for (size_t x{ 0 }; x < img.get_w(); ++x) {
+                    if (mask && !(*mask)(x, y)) {
+                        continue;
+                    }
+                    const uint32_t packed{ uint32_t{ rows[0][x] } | uint32_t{ rows[1][x] } << 8 |
+                                           uint32_t{ rows[2][x] } << 16 | uint32_t{ rows[3][x] } << 24 };
+                    if (!dense || packed >> 24 != 0xFF) {
+                        histogram.listed.push_back(packed);
+                        continue;
+                    }
+                    const size_t bin{ bin_of(packed) };
+                    histogram.counts[bin]++;
+                    if (binned) {
+                        histogram.sums[bin][0] += packed & 0xFF;
+                        histogram.sums[bin][1] += packed >> 8 & 0xFF;
+                        histogram.sums[bin][2] += packed >> 16 & 0xFF;
+                    }
+                }
+            }
+        }
+    });
+
+    ColorHistogram& merged{ histograms.front() };
+    if (dense && chunk_count > 1) {
+        thread_pool.parallel_for(0, bin_count, 0, [&](size_t begin, size_t end) {
+            for (size_t chunk{ 1 }; chunk < chunk_count; ++chunk) {
+                for (size_t bin{ begin }; bin < end; ++bin) {
+                    merged.counts[bin] += histograms[chunk].counts[bin];
+                }
+                if (binned) {
+                    for (size_t bin{ begin }; bin < end; ++bin) {
+                        for (size_t c{ 0 }; c < 3; ++c) {
+                            merged.sums[bin][c] += histograms[chunk].sums[bin][c];
+                        }
+                    }
+                }
             }
         });
-        return task_colors;
-    };
+    }
+    for (size_t chunk{ 1 }; chunk < chunk_count; ++chunk) {
+        merged.listed.insert(merged.listed.end(), histograms[chunk].listed.cbegin(), histograms[chunk].listed.cend());
+        histograms[chunk] = {};
+    }
+
+    colors = thread_pool.parallel_reduce(
+        0,
+        merged.counts.size(),
+        0,
+        WeightedColors{},
+        [&](size_t begin, size_t end) {
+            WeightedColors chunk_colors;
+            for (size_t bin{ begin }; bin < end; ++bin) {
+                const uint32_t count{ merged.counts[bin] };
+                if (count == 0) {
+                    continue;
+                }
+                if (binned) {
+                    const double scale{ 255.0 * count };
+                    chunk_colors.push_back(Color{ static_cast<double>(merged.sums[bin][0]) / scale,
+                                                  static_cast<double>(merged.sums[bin][1]) / scale,
+                                                  static_cast<double>(merged.sums[bin][2]) / scale },
+                                           count);
+                } else {
+                    const uint32_t packed{ static_cast<uint32_t>(bin >> 16) | static_cast<uint32_t>(bin & 0xFF00) |
+                                           static_cast<uint32_t>(bin & 0xFF) << 16 | 0xFF000000 };
+                    chunk_colors.push_back(unpack_color(packed), count);
+                }
+            }
+            return chunk_colors;
+        },
+        [](WeightedColors merged_colors, const WeightedColors& chunk_colors) {
+            merged_colors.append(chunk_colors);
+            return merged_colors;
+        });
 
-    std::vector<std::future<std::unordered_map<Color, size_t>>> futures;
-    futures.reserve(n_tasks);
-    for (size_t y_start{ 0 }; y_start < img.get_h(); y_start += rows_per_task) {
-        size_t y_end{ std::min(y_start + rows_per_task, img.get_h()) };
-        futures.push_back(thread_pool.submit(1, f, img.get_cregion(0, y_start, img.get_w(), y_end)));
+    std::sort(merged.listed.begin(), merged.listed.end());
+    for (auto it{ merged.listed.cbegin() }; it != merged.listed.cend();) {
+        const auto run_end{ std::find_if(it, merged.listed.cend(), [it](uint32_t p) { return p != *it; }) };
+        colors.push_back(unpack_color(*it), static_cast<uint32_t>(run_end - it));
+        it = run_end;
     }
+}
 
-    colors.reserve(img.get_w() * img.get_h());
-    for (auto& f : futures) {
-        auto task_colors{ f.get() };
-        for (const auto& [color, count] : task_colors) {
-            colors[color] += count;
-        }
+ImageColorQuantizer::ImageColorQuantizer(const Img& img,
+                                         const std::vector<Color>& const_centroids,
+                                         ThreadPool& thread_pool,
+                                         const std::optional<Array2d<uint8_t>>& mask,
+                                         uint32_t histogram_bits)
+    : ImageColorQuantizer{
+        PlanarImg{ img, PlanarImg::Precision::U8 }, const_centroids, thread_pool, mask, histogram_bits
     }
+{
 }
 
 std::vector<Color> ImageColorQuantizer::get_pallete(uint32_t n_colors,
                                                     uint32_t n_iter,
                                                     double threshold,
-                                                    size_t seed) const
+                                                    size_t seed,
+                                                    PaletteMethod method,
+                                                    KMeansMode mode) const
 {
     if (n_colors == 0 || colors.empty()) {
         Logger::error("No colors to create palette from");
@@ -64,115 +312,633 @@ std::vector<Color> ImageColorQuantizer::get_pallete(uint32_t n_colors,
     if (n_colors == colors.size()) {
         std::vector<Color> palette;
         palette.reserve(colors.size());
-        std::transform(colors.cbegin(), colors.cend(), std::back_inserter(palette), [](const auto& color_pair) {
-            return color_pair.first;
-        });
+        for (size_t i{ 0 }; i < colors.size(); ++i) {
+            palette.push_back(colors.get_color(i));
+        }
         return palette;
     }
-    Logger::info("Clustering {} colors into {} colors", colors.size(), n_colors);
+    if (method != PaletteMethod::K_MEANS) {
+        std::vector<Color> palette{ median_cut(n_colors) };
+        if (method == PaletteMethod::MEDIAN_CUT) {
+            Logger::info("Median cut {} colors into {} colors", colors.size(), n_colors);
+            return palette;
+        }
+        Logger::info("Clustering {} colors into {} colors from a median cut", colors.size(), n_colors);
+        std::atomic<double> best_inertia{ std::numeric_limits<double>::infinity() };
+        auto [centroids, inertia] = k_means(std::move(palette), threshold, best_inertia);
+        Logger::info("Inertia: {:.2f}", inertia);
+        return centroids;
+    }
+
+    const bool mini_batch{ mode == KMeansMode::MINI_BATCH ||
+                           (mode == KMeansMode::AUTO && colors.size() >= MINI_BATCH_MIN_COLORS) };
+    Logger::info(
+        "Clustering {} colors into {} colors{}", colors.size(), n_colors, mini_batch ? " in mini-batches" : "");
 
-    std::function<std::pair<std::vector<Color>, double>(uint32_t, double)> f =
-        [this](uint32_t n_colors, double threshold) { return k_means(n_colors, threshold); };
+    const std::optional<ColorSampler> sampler{ mini_batch ? std::optional<ColorSampler>{ colors.counts }
+                                                          : std::nullopt };
+
+    std::atomic<double> best_inertia{ std::numeric_limits<double>::infinity() };
+    auto f = [this, &sampler, &best_inertia](uint32_t n_colors, double threshold) {
+        return sampler ? mini_batch_k_means(n_colors, *sampler, best_inertia)
+                       : k_means(seed_centroids(n_colors, {}), threshold, best_inertia);
+    };
 
-    std::vector<std::future<std::pair<std::vector<Color>, double>>> futures;
+    std::vector<ThreadPool::Future<std::pair<std::vector<Color>, double>>> futures;
     futures.reserve(n_iter);
     for (uint32_t i = 0; i < n_iter; ++i) {
-        futures.push_back(thread_pool.submit(1, f, n_colors, threshold));
+        futures.push_back(thread_pool.submit(K_MEANS_RESTART_PRIORITY, f, n_colors, threshold));
     }
 
     std::vector<std::pair<std::vector<Color>, double>> results;
     results.reserve(n_iter);
     for (auto& f : futures) {
-        results.emplace_back(f.get());
+        results.emplace_back(thread_pool.wait(f));
     }
 
     const auto best_result = std::min_element(
         results.cbegin(), results.cend(), [](const auto& a, const auto& b) { return a.second < b.second; });
     const auto& [centroids, inertia] = *best_result;
+    const auto abandoned = std::count_if(
+        results.cbegin(), results.cend(), [](const auto& result) { return std::isinf(result.second); });
+    Logger::info("Best inertia: {:.2f}, {} of {} restarts abandoned", inertia, abandoned, n_iter);
 
     return centroids;
 }
 
-std::pair<std::vector<Color>, double> ImageColorQuantizer::k_means(size_t k, double threshold) const
+// Hamerly's k-means: every color keeps an upper bound of the distance to its centroid and a lower bound of the distance
+// to any other, moved by how far the centroids moved, and is only compared with all centroids when the bounds overlap
+std::pair<std::vector<Color>, double> ImageColorQuantizer::k_means(std::vector<Color> centroids,
+                                                                   double threshold,
+                                                                   std::atomic<double>& best_inertia) const
 {
-    std::vector<Color> centroids;
-    centroids.reserve(k);
-
-    std::vector<std::pair<Vec4<size_t>, size_t>> new_centroids;
-    new_centroids.reserve(k);
+    const size_t k{ centroids.size() };
 
-    for (uint32_t i = 0; i < k; ++i) {
-        centroids.push_back(random_color());
+    // free centroids come before the constant ones, so a tie goes to the free one
+    const size_t k_total{ k + const_centroids.size() };
+    std::array<std::vector<float>, Color::CHANNELS> centers;
+    for (std::vector<float>& channel : centers) {
+        channel.resize(k_total);
     }
+    auto set_center = [&centers](size_t j, const Color& color) {
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            centers[c][j] = color[c];
+        }
+    };
+    for (size_t j{ 0 }; j < k; ++j) {
+        set_center(j, centroids[j]);
+    }
+    for (size_t j{ 0 }; j < const_centroids.size(); ++j) {
+        set_center(k + j, const_centroids[j]);
+    }
+
+    // colors of a cluster summed as the centroid update and the inertia need them
+    struct Cluster
+    {
+        Vec4<size_t> sum;
+        size_t count;
+        std::array<double, Color::CHANNELS> color_sum;
+        double square_sum;
+    };
+    const std::vector<Cluster> empty_clusters(k_total, { { 0, 0, 0, 0 }, 0, { 0.0, 0.0, 0.0, 0.0 }, 0.0 });
+    std::vector<Cluster> clusters{ empty_clusters };
+    // in partial sums of a chunk the counts can go below zero, they wrap around and come back once added up
+    auto move_color = [this](size_t i, size_t from, size_t to, std::vector<Cluster>& clusters) {
+        const Color color{ colors.get_color(i) };
+        const Vec4<size_t> scaled_sum{ static_cast<Vec4<size_t>>(color * 255) * colors.counts[i] };
+        const double count{ static_cast<double>(colors.counts[i]) };
+        const double square{ color.dist_sq(Color{ 0.0, 0.0, 0.0, 0.0 }) * count };
+        if (from < clusters.size()) {
+            Cluster& cluster{ clusters[from] };
+            cluster.sum -= scaled_sum;
+            cluster.count -= colors.counts[i];
+            for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+                cluster.color_sum[c] -= color[c] * count;
+            }
+            cluster.square_sum -= square;
+        }
+        Cluster& cluster{ clusters[to] };
+        cluster.sum += scaled_sum;
+        cluster.count += colors.counts[i];
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            cluster.color_sum[c] += color[c] * count;
+        }
+        cluster.square_sum += square;
+    };
+    auto add_clusters = [](std::vector<Cluster> sums, const std::vector<Cluster>& other) {
+        for (size_t j{ 0 }; j < sums.size(); ++j) {
+            sums[j].sum += other[j].sum;
+            sums[j].count += other[j].count;
+            for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+                sums[j].color_sum[c] += other[j].color_sum[c];
+            }
+            sums[j].square_sum += other[j].square_sum;
+        }
+        return sums;
+    };
 
-    double delta{ std::numeric_limits<double>::max() };
+    // squared distances to the nearest and second nearest centroid
+    auto find_nearest = [&](size_t i, std::vector<double>& dist_sq) -> std::tuple<uint32_t, double, double> {
+        std::fill(dist_sq.begin(), dist_sq.end(), 0.0);
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            const float value{ colors.channels[c][i] };
+            const float* center{ centers[c].data() };
+            for (size_t j{ 0 }; j < k_total; ++j) {
+                const double diff{ value - center[j] };
+                dist_sq[j] += diff * diff;
+            }
+        }
+        uint32_t nearest{ 0 };
+        double nearest_dist_sq{ std::numeric_limits<double>::max() };
+        double second_dist_sq{ std::numeric_limits<double>::max() };
+        for (uint32_t j{ 0 }; j < k_total; ++j) {
+            if (dist_sq[j] < nearest_dist_sq) {
+                second_dist_sq = nearest_dist_sq;
+                nearest_dist_sq = dist_sq[j];
+                nearest = j;
+            } else if (dist_sq[j] < second_dist_sq) {
+                second_dist_sq = dist_sq[j];
+            }
+        }
+        return { nearest, nearest_dist_sq, second_dist_sq };
+    };
+    auto center_dist = [&centers](size_t i, size_t j) {
+        double result{ 0.0 };
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            const double diff{ centers[c][i] - centers[c][j] };
+            result += diff * diff;
+        }
+        return std::sqrt(result);
+    };
 
-    while (delta > threshold) {
-        new_centroids.assign(k, { { 0, 0, 0, 0 }, 0 });
+    // runs assign(i, partial_clusters, dist_sq) over the colors in fixed chunks, so the sums do not depend on the
+    // thread count, and adds the partial cluster sums of the chunks to the clusters
+    const size_t n{ colors.size() };
+    auto assign_colors = [&](auto&& assign) {
+        auto map = [&](size_t begin, size_t end) {
+            std::vector<Cluster> partial_clusters{ empty_clusters };
+            std::vector<double> dist_sq(k_total);
+            for (size_t i{ begin }; i < end; ++i) {
+                assign(i, partial_clusters, dist_sq);
+            }
+            return partial_clusters;
+        };
+        clusters = add_clusters(
+            std::move(clusters),
+            thread_pool.parallel_reduce(0, n, K_MEANS_GRAIN, empty_clusters, map, add_clusters, K_MEANS_PRIORITY));
+    };
 
-        for (const auto& [color, color_count] : colors) {
-            const auto closest_const_centroid = std::min_element(
-                const_centroids.begin(), const_centroids.end(), [&color](const Color& a, const Color& b) {
-                    return color.dist_sq(a) < color.dist_sq(b);
-                });
-            const auto closest_centroid =
-                std::min_element(centroids.begin(), centroids.end(), [&color](const Color& a, const Color& b) {
-                    return color.dist_sq(a) < color.dist_sq(b);
-                });
+    std::vector<uint32_t> assignments(n);
+    std::vector<double> upper_bounds(n);
+    std::vector<double> lower_bounds(n);
+    assign_colors([&](size_t i, std::vector<Cluster>& partial_clusters, std::vector<double>& dist_sq) {
+        const auto [nearest, nearest_dist_sq, second_dist_sq] = find_nearest(i, dist_sq);
+        assignments[i] = nearest;
+        upper_bounds[i] = std::sqrt(nearest_dist_sq);
+        lower_bounds[i] = std::sqrt(second_dist_sq);
+        move_color(i, k_total, nearest, partial_clusters);
+    });
 
-            if (closest_const_centroid != const_centroids.end() &&
-                color.dist_sq(*closest_const_centroid) < color.dist_sq(*closest_centroid)) {
+    // the sum of squared distances of the current assignment to the current centroids, from the cluster sums
+    auto get_inertia = [&clusters, &centers, k_total]() {
+        double inertia{ 0.0 };
+        for (size_t j{ 0 }; j < k_total; ++j) {
+            const Cluster& cluster{ clusters[j] };
+            if (cluster.count == 0) {
                 continue;
             }
+            double cross{ 0.0 };
+            double center_square{ 0.0 };
+            for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+                cross += cluster.color_sum[c] * centers[c][j];
+                center_square += static_cast<double>(centers[c][j]) * centers[c][j];
+            }
+            const double count{ static_cast<double>(cluster.count) };
+            inertia += std::max(cluster.square_sum - (2.0 * cross) + (count * center_square), 0.0);
+        }
+        return inertia;
+    };
 
-            const auto index = std::distance(centroids.begin(), closest_centroid);
-
-            auto& [new_centroid, new_centroid_count] = new_centroids[index];
-            new_centroid += static_cast<Vec4<size_t>>(color * 255) * color_count;
-            new_centroid_count += color_count;
+    std::vector<double> moves(k_total, 0.0);
+    std::vector<double> half_gaps(k_total);
+    while (true) {
+        double delta{ 0.0 };
+        for (size_t j{ 0 }; j < k; ++j) {
+            const Cluster& cluster{ clusters[j] };
+            moves[j] = 0.0;
+            if (cluster.count == 0) {
+                continue;
+            }
+            Vec4<float> new_centroid_float{ cluster.sum };
+            new_centroid_float /= cluster.count * 255.0f;
+            const double move_sq{ new_centroid_float.dist_sq(centroids[j]) };
+            delta += move_sq;
+            moves[j] = std::sqrt(move_sq);
+            centroids[j] = {
+                new_centroid_float[0], new_centroid_float[1], new_centroid_float[2], new_centroid_float[3]
+            };
+            set_center(j, centroids[j]);
+        }
+        if (delta <= threshold) {
+            break;
+        }
+        // later iterations rarely bring a run this far behind the best finished one back into the lead
+        if (get_inertia() > best_inertia.load(std::memory_order_relaxed) * ABANDON_INERTIA_RATIO) {
+            return { {}, std::numeric_limits<double>::infinity() };
         }
 
-        delta = 0.0;
-        std::transform(
-            new_centroids.cbegin(),
-            new_centroids.cend(),
-            centroids.cbegin(),
-            centroids.begin(),
-            [&delta](const auto& new_centroid_pair, const Color& centroid) -> Color {
-                const auto& [new_centroid, new_centroid_count] = new_centroid_pair;
-                if (new_centroid_count == 0) {
-                    return centroid;
+        const auto max_move{ std::max_element(moves.cbegin(), moves.cend()) };
+        const size_t max_moved{ static_cast<size_t>(max_move - moves.cbegin()) };
+        double second_move{ 0.0 };
+        for (size_t j{ 0 }; j < k_total; ++j) {
+            if (j != max_moved) {
+                second_move = std::max(second_move, moves[j]);
+            }
+        }
+        for (size_t j{ 0 }; j < k_total; ++j) {
+            half_gaps[j] = std::numeric_limits<double>::max();
+            for (size_t other{ 0 }; other < k_total; ++other) {
+                if (other != j) {
+                    half_gaps[j] = std::min(half_gaps[j], center_dist(j, other) / 2.0);
                 }
-                Vec4<float> new_centroid_float{ new_centroid };
-                new_centroid_float /= new_centroid_count * 255.0f;
-                delta += new_centroid_float.dist_sq(centroid);
-                return { new_centroid_float[0], new_centroid_float[1], new_centroid_float[2], new_centroid_float[3] };
-            });
+            }
+        }
+
+        assign_colors([&](size_t i, std::vector<Cluster>& partial_clusters, std::vector<double>& dist_sq) {
+            const uint32_t assigned{ assignments[i] };
+            upper_bounds[i] += moves[assigned];
+            lower_bounds[i] -= assigned == max_moved ? second_move : *max_move;
+            const double bound{ std::max(half_gaps[assigned], lower_bounds[i]) };
+            if (upper_bounds[i] <= bound) {
+                return;
+            }
+            upper_bounds[i] = std::sqrt(colors.get_color(i).dist_sq(
+                { centers[0][assigned], centers[1][assigned], centers[2][assigned], centers[3][assigned] }));
+            if (upper_bounds[i] <= bound) {
+                return;
+            }
+            const auto [nearest, nearest_dist_sq, second_dist_sq] = find_nearest(i, dist_sq);
+            upper_bounds[i] = std::sqrt(nearest_dist_sq);
+            lower_bounds[i] = std::sqrt(second_dist_sq);
+            if (nearest != assigned) {
+                move_color(i, assigned, nearest, partial_clusters);
+                assignments[i] = nearest;
+            }
+        });
+    }
+
+    const double inertia{ get_inertia() };
+    double expected{ best_inertia.load(std::memory_order_relaxed) };
+    while (inertia < expected && !best_inertia.compare_exchange_weak(expected, inertia)) {
     }
+    return { centroids, inertia };
+}
+
+// Sculley's mini-batch k-means: every batch moves the centroid nearest to each sampled color towards it by the inverse
+// of the colors it has been given so far, colors are sampled by their counts so they all weigh the same
+std::pair<std::vector<Color>, double> ImageColorQuantizer::mini_batch_k_means(
+    size_t k,
+    const ColorSampler& sampler,
+    std::atomic<double>& best_inertia) const
+{
+    auto sample = [&sampler](std::vector<size_t>& batch) {
+        for (size_t& i : batch) {
+            i = sampler(ThreadRng::rng);
+        }
+    };
 
-    double inertia{ 0.0 };
-    for (const auto& [color, color_count] : colors) {
-        const auto closest_const_centroid =
-            std::min_element(const_centroids.begin(), const_centroids.end(), [&color](const Color& a, const Color& b) {
-                return color.dist_sq(a) < color.dist_sq(b);
-            });
-        const auto closest_centroid =
-            std::min_element(centroids.begin(), centroids.end(), [&color](const Color& a, const Color& b) {
-                return color.dist_sq(a) < color.dist_sq(b);
-            });
+    std::vector<size_t> batch(MINI_BATCH_SEED_SAMPLE);
+    sample(batch);
+    std::vector<Color> centroids{ seed_centroids(k, batch) };
 
-        if (closest_const_centroid != const_centroids.end() &&
-            color.dist_sq(*closest_const_centroid) < color.dist_sq(*closest_centroid)) {
-            inertia += color.dist_sq(*closest_const_centroid) * color_count;
-        } else {
-            inertia += color.dist_sq(*closest_centroid) * color_count;
+    // free centroids come before the constant ones, so a tie goes to the free one
+    const size_t k_total{ k + const_centroids.size() };
+    std::array<std::vector<float>, Color::CHANNELS> centers;
+    for (std::vector<float>& channel : centers) {
+        channel.resize(k_total);
+    }
+    auto set_center = [&centers](size_t j, const Color& color) {
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            centers[c][j] = color[c];
+        }
+    };
+    for (size_t j{ 0 }; j < k; ++j) {
+        set_center(j, centroids[j]);
+    }
+    for (size_t j{ 0 }; j < const_centroids.size(); ++j) {
+        set_center(k + j, const_centroids[j]);
+    }
+
+    std::vector<double> dist_sq(k_total);
+    auto find_nearest = [&](size_t i) {
+        std::fill(dist_sq.begin(), dist_sq.end(), 0.0);
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            const float value{ colors.channels[c][i] };
+            const float* center{ centers[c].data() };
+            for (size_t j{ 0 }; j < k_total; ++j) {
+                const double diff{ value - center[j] };
+                dist_sq[j] += diff * diff;
+            }
+        }
+        return static_cast<uint32_t>(std::min_element(dist_sq.cbegin(), dist_sq.cend()) - dist_sq.cbegin());
+    };
+
+    batch.resize(MINI_BATCH_SIZE);
+    std::vector<uint32_t> batch_nearest(MINI_BATCH_SIZE);
+    std::vector<uint64_t> given(k, 0);
+    for (size_t iteration{ 0 }; iteration < MINI_BATCH_ITERATIONS; ++iteration) {
+        sample(batch);
+        for (size_t b{ 0 }; b < MINI_BATCH_SIZE; ++b) {
+            batch_nearest[b] = find_nearest(batch[b]);
+        }
+        for (size_t b{ 0 }; b < MINI_BATCH_SIZE; ++b) {
+            const uint32_t j{ batch_nearest[b] };
+            if (j >= k) {
+                continue;
+            }
+            const float rate{ 1.0f / static_cast<float>(++given[j]) };
+            for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+                centers[c][j] += rate * (colors.channels[c][batch[b]] - centers[c][j]);
+            }
         }
     }
+    for (size_t j{ 0 }; j < k; ++j) {
+        centroids[j] = { centers[0][j], centers[1][j], centers[2][j], centers[3][j] };
+    }
+
+    // one full pass over blocks of colors, centroid by centroid so it vectorizes over the colors of a block
+    auto get_block_inertia = [this, &centers, k_total](size_t chunk_begin, size_t chunk_end) {
+        constexpr size_t BLOCK{ 256 };
+        std::array<float, BLOCK> nearest_dist_sq;
+        std::array<float, BLOCK> color_dist_sq;
+        double inertia{ 0.0 };
+        for (size_t begin{ chunk_begin }; begin < chunk_end; begin += BLOCK) {
+            const size_t block{ std::min(BLOCK, chunk_end - begin) };
+            std::fill(nearest_dist_sq.begin(), nearest_dist_sq.end(), std::numeric_limits<float>::max());
+            for (size_t j{ 0 }; j < k_total; ++j) {
+                std::fill(color_dist_sq.begin(), color_dist_sq.end(), 0.0f);
+                for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+                    const float value{ centers[c][j] };
+                    const float* channel{ colors.channels[c].data() + begin };
+                    for (size_t i{ 0 }; i < block; ++i) {
+                        const float diff{ channel[i] - value };
+                        color_dist_sq[i] += diff * diff;
+                    }
+                }
+                for (size_t i{ 0 }; i < block; ++i) {
+                    nearest_dist_sq[i] = std::min(nearest_dist_sq[i], color_dist_sq[i]);
+                }
+            }
+            for (size_t i{ 0 }; i < block; ++i) {
+                inertia += static_cast<double>(nearest_dist_sq[i]) * colors.counts[begin + i];
+            }
+        }
+        return inertia;
+    };
+    const double inertia{ thread_pool.parallel_reduce(0,
+                                                      colors.size(),
+                                                      K_MEANS_GRAIN,
+                                                      0.0,
+                                                      get_block_inertia,
+                                                      std::plus<double>{},
+                                                      K_MEANS_PRIORITY) };
 
+    double expected{ best_inertia.load(std::memory_order_relaxed) };
+    while (inertia < expected && !best_inertia.compare_exchange_weak(expected, inertia)) {
+    }
     return { centroids, inertia };
 }
 
-Color ImageColorQuantizer::random_color()
+// Wu's quantizer: the box of colors with the greatest squared error is cut in two where the halves lose the most of it,
+// along whichever channel does best, until there is a box for every centroid. The constant centroids then take the
+// boxes nearest to them
+std::vector<Color> ImageColorQuantizer::median_cut(size_t k) const
 {
-    return Color{ ThreadRng::uniform_int(0, 255), ThreadRng::uniform_int(0, 255), ThreadRng::uniform_int(0, 255) };
-}
\ No newline at end of file
+    using Box = MomentTable::Box;
+    const MomentTable table{ colors.channels, colors.counts };
+    auto get_error = [&table](const Box& box) {
+        const Moments moments{ table.get(box) };
+        return moments.square_sum - moments.get_mean_square();
+    };
+
+    const size_t box_count{ k + const_centroids.size() };
+    std::vector<Box> boxes{ { { 0, 0, 0 }, { MomentTable::SIDE - 1, MomentTable::SIDE - 1, MomentTable::SIDE - 1 } } };
+    std::vector<double> errors{ get_error(boxes[0]) };
+    while (boxes.size() < box_count) {
+        const size_t i{ static_cast<size_t>(std::max_element(errors.cbegin(), errors.cend()) - errors.cbegin()) };
+        if (errors[i] <= 0.0) {
+            break;
+        }
+        const Box& box{ boxes[i] };
+        const Moments whole{ table.get(box) };
+        double best_score{ whole.get_mean_square() };
+        std::optional<std::pair<Box, Box>> best_cut;
+        for (size_t axis{ 0 }; axis < 3; ++axis) {
+            for (size_t level{ box.lower[axis] + 1 }; level < box.upper[axis]; ++level) {
+                Box lower_half{ box };
+                Box upper_half{ box };
+                lower_half.upper[axis] = level;
+                upper_half.lower[axis] = level;
+                const Moments lower_moments{ table.get(lower_half) };
+                const Moments upper_moments{ whole - lower_moments };
+                if (lower_moments.weight <= 0.0 || upper_moments.weight <= 0.0) {
+                    continue;
+                }
+                const double score{ lower_moments.get_mean_square() + upper_moments.get_mean_square() };
+                if (score > best_score) {
+                    best_score = score;
+                    best_cut = { lower_half, upper_half };
+                }
+            }
+        }
+        if (!best_cut) {
+            // colors of a single level of every channel, they stay together
+            errors[i] = 0.0;
+            continue;
+        }
+        boxes[i] = best_cut->first;
+        errors[i] = get_error(boxes[i]);
+        boxes.push_back(best_cut->second);
+        errors.push_back(get_error(boxes.back()));
+    }
+
+    std::vector<Color> palette;
+    for (const Box& box : boxes) {
+        const Moments moments{ table.get(box) };
+        palette.push_back({ static_cast<float>(moments.sums[0] / moments.weight),
+                            static_cast<float>(moments.sums[1] / moments.weight),
+                            static_cast<float>(moments.sums[2] / moments.weight),
+                            static_cast<float>(moments.sums[3] / moments.weight) });
+    }
+    for (const Color& centroid : const_centroids) {
+        if (palette.size() <= k) {
+            break;
+        }
+        palette.erase(std::min_element(palette.cbegin(), palette.cend(), [&centroid](const Color& a, const Color& b) {
+            return a.dist_sq(centroid) < b.dist_sq(centroid);
+        }));
+    }
+
+    // too few distinct levels for a box each, the rest are the colors worst served so far
+    std::vector<double> nearest_dist_sq(colors.size(), std::numeric_limits<double>::max());
+    auto add_nearest = [this, &nearest_dist_sq](const Color& centroid) {
+        for (size_t i{ 0 }; i < colors.size(); ++i) {
+            nearest_dist_sq[i] = std::min(nearest_dist_sq[i], colors.get_color(i).dist_sq(centroid));
+        }
+    };
+    if (palette.size() < k) {
+        std::for_each(palette.cbegin(), palette.cend(), add_nearest);
+        std::for_each(const_centroids.cbegin(), const_centroids.cend(), add_nearest);
+    }
+    while (palette.size() < k) {
+        size_t worst{ 0 };
+        for (size_t i{ 1 }; i < colors.size(); ++i) {
+            if (nearest_dist_sq[i] * colors.counts[i] > nearest_dist_sq[worst] * colors.counts[worst]) {
+                worst = i;
+            }
+        }
+        palette.push_back(colors.get_color(worst));
+        add_nearest(palette.back());
+    }
+    return palette;
+}
+
+// k-means++: every centroid is a color drawn with probability proportional to its weight times its squared distance
+// to the nearest centroid picked so far, the constant ones included. A color weighs its count, a sampled color one
+std::vector<Color> ImageColorQuantizer::seed_centroids(size_t k, const std::vector<size_t>& sample) const
+{
+    const size_t n{ sample.empty() ? colors.size() : sample.size() };
+    // the histogram is read in place, only a sample is gathered
+    std::array<std::vector<float>, Color::CHANNELS> sampled_channels;
+    std::array<const float*, Color::CHANNELS> channels;
+    for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+        if (sample.empty()) {
+            channels[c] = colors.channels[c].data();
+            continue;
+        }
+        sampled_channels[c].resize(n);
+        for (size_t i{ 0 }; i < n; ++i) {
+            sampled_channels[c][i] = colors.channels[c][sample[i]];
+        }
+        channels[c] = sampled_channels[c].data();
+    }
+    const uint32_t* counts{ sample.empty() ? colors.counts.data() : nullptr };
+    auto weight = [counts](size_t i) { return counts != nullptr ? static_cast<double>(counts[i]) : 1.0; };
+
+    // the weight alone until the first centroid is picked
+    std::vector<double> nearest_dist_sq(n, 1.0);
+    std::vector<double> dist_sq(n);
+    bool picked{ false };
+    auto pick = [&](const Color& centroid) {
+        std::fill(dist_sq.begin(), dist_sq.end(), 0.0);
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            const float value{ centroid[c] };
+            const float* channel{ channels[c] };
+            for (size_t i{ 0 }; i < n; ++i) {
+                const double diff{ channel[i] - value };
+                dist_sq[i] += diff * diff;
+            }
+        }
+        for (size_t i{ 0 }; i < n; ++i) {
+            nearest_dist_sq[i] = picked ? std::min(nearest_dist_sq[i], dist_sq[i]) : dist_sq[i];
+        }
+        picked = true;
+    };
+    for (const Color& centroid : const_centroids) {
+        pick(centroid);
+    }
+
+    std::vector<Color> centroids;
+    centroids.reserve(k);
+    for (size_t j{ 0 }; j < k; ++j) {
+        double total{ 0.0 };
+        for (size_t i{ 0 }; i < n; ++i) {
+            total += weight(i) * nearest_dist_sq[i];
+        }
+        // every color already is a centroid, any of them will do
+        size_t chosen{ static_cast<size_t>(ThreadRng::uniform_int(0, static_cast<int>(n - 1))) };
+        if (total > 0.0) {
+            const double target{ ThreadRng::uniform_real(0.0, total) };
+            double cumulative{ 0.0 };
+            for (chosen = 0; chosen + 1 < n; ++chosen) {
+                cumulative += weight(chosen) * nearest_dist_sq[chosen];
+                if (cumulative > target) {
+                    break;
+                }
+            }
+        }
+        centroids.push_back(colors.get_color(sample.empty() ? chosen : sample[chosen]));
+        pick(centroids.back());
+    }
+    return centroids;
+}
+
+ImageColorQuantizer::ColorSampler::ColorSampler(const std::vector<uint32_t>& counts)
+    : probabilities(counts.size(), 1.0)
+    , aliases(counts.size())
+{
+    const double total{ std::accumulate(counts.cbegin(), counts.cend(), 0.0) };
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+    for (uint32_t i{ 0 }; i < counts.size(); ++i) {
+        aliases[i] = i;
+        probabilities[i] = counts[i] * static_cast<double>(counts.size()) / total;
+        (probabilities[i] < 1.0 ? small : large).push_back(i);
+    }
+    // every slot under its share is filled up by one over it, which then is under or over by what it gave
+    while (!small.empty() && !large.empty()) {
+        const uint32_t under{ small.back() };
+        const uint32_t over{ large.back() };
+        small.pop_back();
+        aliases[under] = over;
+        probabilities[over] -= 1.0 - probabilities[under];
+        if (probabilities[over] < 1.0) {
+            large.pop_back();
+            small.push_back(over);
+        }
+    }
+    // rounding leaves either kind with a share of about one
+    for (const uint32_t i : small) {
+        probabilities[i] = 1.0;
+    }
+    for (const uint32_t i : large) {
+        probabilities[i] = 1.0;
+    }
+}
+
+size_t ImageColorQuantizer::ColorSampler::operator()(std::mt19937& rng) const
+{
+    const size_t slot{ std::uniform_int_distribution<size_t>{ 0, probabilities.size() - 1 }(rng) };
+    return std::uniform_real_distribution<double>{ 0.0, 1.0 }(rng) < probabilities[slot] ? slot : aliases[slot];
+}
+
+void ImageColorQuantizer::WeightedColors::push_back(const Color& color, uint32_t count)
+{
+    for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+        channels[c].push_back(color[c]);
+    }
+    counts.push_back(count);
+}
+
+void ImageColorQuantizer::WeightedColors::append(const WeightedColors& other)
+{
+    for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+        channels[c].insert(channels[c].end(), other.channels[c].cbegin(), other.channels[c].cend());
+    }
+    counts.insert(counts.end(), other.counts.cbegin(), other.counts.cend());
+}
+
+size_t ImageColorQuantizer::WeightedColors::size() const
+{
+    return counts.size();
+}
+
+bool ImageColorQuantizer::WeightedColors::empty() const
+{
+    return counts.empty();
+}
+
+Color ImageColorQuantizer::WeightedColors::get_color(size_t i) const
+{
+    return { channels[0][i], channels[1][i], channels[2][i], channels[3][i] };
+}
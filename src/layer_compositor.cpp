@@ -0,0 +1,207 @@
+#include "layer_compositor.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <numeric>
+
+// LayerCompositor::Coverage
+LayerCompositor::Coverage::Coverage(const PlanarImg& target_img,
+                                    const std::vector<const Img*>& layers,
+                                    ThreadPool& thread_pool)
+    : pixel_offsets(target_img.size() + 1, 0)
+    , layer_pixels(layers.size())
+{
+    const size_t pixel_count{ target_img.size() };
+    const size_t w{ target_img.get_w() };
+    for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+        target_channels[c].resize(pixel_count);
+        for (size_t y{ 0 }; y < target_img.get_h(); ++y) {
+            target_img.load_row(c, y, target_channels[c].data() + (y * w));
+        }
+    }
+
+    thread_pool.parallel_for(0, layers.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t layer_id{ begin }; layer_id < end; ++layer_id) {
+            assert(layers[layer_id]->size() == pixel_count);
+            const Color* colors{ layers[layer_id]->data() };
+            for (uint32_t p{ 0 }; p < pixel_count; ++p) {
+                if (colors[p].a() > 0.0f) {
+                    layer_pixels[layer_id].push_back(p);
+                }
+            }
+        }
+    });
+
+    for (const std::vector<uint32_t>& pixels : layer_pixels) {
+        for (const uint32_t p : pixels) {
+            pixel_offsets[p + 1]++;
+        }
+    }
+    for (size_t p{ 0 }; p < pixel_count; ++p) {
+        pixel_offsets[p + 1] += pixel_offsets[p];
+    }
+    pixel_layers.resize(pixel_offsets.back());
+    std::vector<size_t> fill(pixel_offsets.cbegin(), pixel_offsets.cend() - 1);
+    for (uint32_t layer_id{ 0 }; layer_id < layers.size(); ++layer_id) {
+        const Color* colors{ layers[layer_id]->data() };
+        for (const uint32_t p : layer_pixels[layer_id]) {
+            const Color& c{ colors[p] };
+            pixel_layers[fill[p]++] = { layer_id, c.r() * c.a(), c.g() * c.a(), c.b() * c.a(), c.a() };
+        }
+    }
+}
+
+size_t LayerCompositor::Coverage::get_pixel_count() const
+{
+    return target_channels[0].size();
+}
+
+Color LayerCompositor::Coverage::get_target(uint32_t p) const
+{
+    return { target_channels[0][p], target_channels[1][p], target_channels[2][p], target_channels[3][p] };
+}
+
+size_t LayerCompositor::Coverage::get_layer_count() const
+{
+    return layer_pixels.size();
+}
+
+size_t LayerCompositor::Coverage::get_pixel_offset(uint32_t p) const
+{
+    return pixel_offsets[p];
+}
+
+size_t LayerCompositor::Coverage::get_entry_count() const
+{
+    return pixel_layers.size();
+}
+
+const LayerCompositor::Coverage::PixelLayer& LayerCompositor::Coverage::get_entry(size_t entry) const
+{
+    return pixel_layers[entry];
+}
+
+const std::vector<uint32_t>& LayerCompositor::Coverage::get_layer_pixels(size_t layer) const
+{
+    return layer_pixels[layer];
+}
+// LayerCompositor::Coverage
+
+// LayerCompositor
+LayerCompositor::LayerCompositor(Color background_color, const Coverage& coverage, ThreadPool& thread_pool)
+    : background_color{ background_color }
+    , coverage{ coverage }
+    , thread_pool{ thread_pool }
+    , pixel_entries(coverage.get_entry_count())
+    , energy{ 0.0 }
+    , pixel_marks(coverage.get_pixel_count(), 0)
+    , mark{ 0 }
+{
+    std::iota(pixel_entries.begin(), pixel_entries.end(), 0);
+}
+
+double LayerCompositor::evaluate(const Order& new_order)
+{
+    assert(new_order.size() == coverage.get_layer_count());
+    if (order.empty()) {
+        order = new_order;
+        layer_ranks.assign(order.size(), 0);
+        for (size_t rank{ 0 }; rank < order.size(); ++rank) {
+            layer_ranks[order[rank]] = static_cast<int>(rank);
+        }
+        return evaluate_all();
+    }
+
+    if (++mark == 0) {
+        std::fill(pixel_marks.begin(), pixel_marks.end(), 0);
+        mark = 1;
+    }
+    dirty_pixels.clear();
+    for (size_t rank{ 0 }; rank < order.size(); ++rank) {
+        if (new_order[rank] == order[rank]) {
+            continue;
+        }
+        layer_ranks[new_order[rank]] = static_cast<int>(rank);
+        for (const uint32_t p : coverage.get_layer_pixels(new_order[rank])) {
+            if (pixel_marks[p] != mark) {
+                pixel_marks[p] = mark;
+                dirty_pixels.push_back(p);
+            }
+        }
+    }
+    order = new_order;
+
+    energy += thread_pool.parallel_reduce(
+        0,
+        dirty_pixels.size(),
+        0,
+        0.0,
+        [this](size_t begin, size_t end) {
+            double delta{ 0.0 };
+            for (size_t i{ begin }; i < end; ++i) {
+                const uint32_t p{ dirty_pixels[i] };
+                const double error{ pixel_error(p) };
+                delta += error - pixel_errors[p];
+                pixel_errors[p] = error;
+            }
+            return delta;
+        },
+        std::plus<>{});
+    return energy;
+}
+
+double LayerCompositor::pixel_error(uint32_t p)
+{
+    uint32_t* const begin{ pixel_entries.data() + coverage.get_pixel_offset(p) };
+    uint32_t* const end{ pixel_entries.data() + coverage.get_pixel_offset(p + 1) };
+    // a neighboring order moves few layers, so the previous order is nearly sorted already
+    for (uint32_t* i{ begin }; i != end; ++i) {
+        const uint32_t entry{ *i };
+        const int rank{ layer_ranks[coverage.get_entry(entry).layer] };
+        uint32_t* j{ i };
+        for (; j != begin && layer_ranks[coverage.get_entry(*(j - 1)).layer] > rank; --j) {
+            *j = *(j - 1);
+        }
+        *j = entry;
+    }
+
+    float r{ background_color.r() * background_color.a() };
+    float g{ background_color.g() * background_color.a() };
+    float b{ background_color.b() * background_color.a() };
+    float a{ background_color.a() };
+    for (const uint32_t* entry{ begin }; entry != end; ++entry) {
+        const Coverage::PixelLayer& layer{ coverage.get_entry(*entry) };
+        const float t{ 1.0f - layer.a };
+        r = layer.r + (t * r);
+        g = layer.g + (t * g);
+        b = layer.b + (t * b);
+        a = layer.a + (t * a);
+    }
+
+    const Color color{ a > 0.0f ? Color{ r / a, g / a, b / a, a } : Color{ r, g, b, a } };
+    const Color diff{ coverage.get_target(p) - color };
+    return (diff.r() * diff.r()) + (diff.g() * diff.g()) + (diff.b() * diff.b());
+}
+
+double LayerCompositor::evaluate_all()
+{
+    const size_t pixel_count{ coverage.get_pixel_count() };
+    pixel_errors.assign(pixel_count, 0.0);
+    energy = thread_pool.parallel_reduce(
+        0,
+        pixel_count,
+        0,
+        0.0,
+        [this](size_t begin, size_t end) {
+            double sum{ 0.0 };
+            for (size_t p{ begin }; p < end; ++p) {
+                pixel_errors[p] = pixel_error(static_cast<uint32_t>(p));
+                sum += pixel_errors[p];
+            }
+            return sum;
+        },
+        std::plus<>{});
+    return energy;
+}
+// LayerCompositor
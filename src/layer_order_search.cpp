@@ -0,0 +1,272 @@
+#include "layer_order_search.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <numeric>
+
+LayerOrderSearch::LayerOrderSearch(const PlanarImg& target_img,
+                                   Color background_color,
+                                   const std::vector<const Img*>& layers,
+                                   size_t factor,
+                                   ThreadPool& thread_pool)
+    : layer_count{ layers.size() }
+    , background{ background_color.r() * background_color.a(),
+                  background_color.g() * background_color.a(),
+                  background_color.b() * background_color.a() }
+    , layer_color_min(layers.size(), { 1.0f, 1.0f, 1.0f })
+    , layer_color_max(layers.size(), { 0.0f, 0.0f, 0.0f })
+    , thread_pool{ thread_pool }
+    , best_energy{ std::numeric_limits<double>::infinity() }
+    , visited{ 0 }
+{
+    assert(layer_count > 0 && layer_count <= MAX_LAYERS);
+    const size_t w{ (target_img.get_w() + factor - 1) / factor };
+    const size_t h{ (target_img.get_h() + factor - 1) / factor };
+    pixel_count = w * h;
+    layer_pixels.assign(layer_count * pixel_count, { 0.0f, 0.0f, 0.0f, 0.0f });
+    pixels.resize(pixel_count);
+    pixel_coverage.assign(pixel_count, 0);
+
+    thread_pool.parallel_for(0, h, 0, [&](size_t begin, size_t end) {
+        for (size_t y{ begin }; y < end; ++y) {
+            for (size_t x{ 0 }; x < w; ++x) {
+                const size_t p{ (y * w) + x };
+                const size_t end_x{ std::min((x + 1) * factor, target_img.get_w()) };
+                const size_t end_y{ std::min((y + 1) * factor, target_img.get_h()) };
+                const float count{ static_cast<float>((end_x - (x * factor)) * (end_y - (y * factor))) };
+
+                Color target{ 0.0, 0.0, 0.0, 0.0 };
+                for (size_t sy{ y * factor }; sy < end_y; ++sy) {
+                    for (size_t sx{ x * factor }; sx < end_x; ++sx) {
+                        const Color c{ target_img.get(sx, sy) };
+                        target = { target.r() + c.r(), target.g() + c.g(), target.b() + c.b(), target.a() + c.a() };
+                        for (size_t l{ 0 }; l < layer_count; ++l) {
+                            const Color& lc{ (*layers[l])(sx, sy) };
+                            std::array<float, 4>& lp{ layer_pixels[(l * pixel_count) + p] };
+                            lp[0] += lc.r() * lc.a();
+                            lp[1] += lc.g() * lc.a();
+                            lp[2] += lc.b() * lc.a();
+                            lp[3] += lc.a();
+                        }
+                    }
+                }
+
+                float transmittance{ 1.0f - background_color.a() };
+                for (size_t l{ 0 }; l < layer_count; ++l) {
+                    std::array<float, 4>& lp{ layer_pixels[(l * pixel_count) + p] };
+                    for (float& v : lp) {
+                        v /= count;
+                    }
+                    transmittance *= 1.0f - lp[3];
+                }
+
+                // same difference as target - composite with Color::operator-, which blends the negated composite
+                // over the target, so its alpha and the share of the target in it do not depend on the order
+                const float alpha{ 1.0f - transmittance };
+                const float t_a{ target.a() / count };
+                const float diff_a{ alpha + (t_a * (1.0f - alpha)) };
+                const float t_share{ t_a * (1.0f - alpha) / count };
+                pixels[p] = { { target.r() * t_share, target.g() * t_share, target.b() * t_share },
+                              diff_a > 0.0f ? count / (diff_a * diff_a) : 0.0f };
+            }
+        }
+    });
+
+    for (size_t l{ 0 }; l < layer_count; ++l) {
+        for (size_t p{ 0 }; p < pixel_count; ++p) {
+            const std::array<float, 4>& lp{ layer_pixels[(l * pixel_count) + p] };
+            if (lp[3] <= 0.0f) {
+                continue;
+            }
+            pixel_coverage[p] |= uint16_t{ 1 } << l;
+            for (size_t c{ 0 }; c < 3; ++c) {
+                layer_color_min[l][c] = std::min(layer_color_min[l][c], lp[c] / lp[3]);
+                layer_color_max[l][c] = std::max(layer_color_max[l][c], lp[c] / lp[3]);
+            }
+        }
+    }
+
+    for (size_t c{ 0 }; c < 3; ++c) {
+        darkest_layers[c].resize(layer_count);
+        std::iota(darkest_layers[c].begin(), darkest_layers[c].end(), 0);
+        brightest_layers[c] = darkest_layers[c];
+        std::stable_sort(darkest_layers[c].begin(), darkest_layers[c].end(), [this, c](int a, int b) {
+            return layer_color_min[a][c] < layer_color_min[b][c];
+        });
+        std::stable_sort(brightest_layers[c].begin(), brightest_layers[c].end(), [this, c](int a, int b) {
+            return layer_color_max[a][c] > layer_color_max[b][c];
+        });
+    }
+}
+
+LayerOrderSearch::Order LayerOrderSearch::solve()
+{
+    // every top layer is its own branch, branches share only the best energy found so far
+    std::vector<Branch> branches(layer_count);
+    thread_pool.parallel_for(0, layer_count, 1, [this, &branches](size_t begin, size_t end) {
+        for (size_t top{ begin }; top < end; ++top) {
+            Branch& branch{ branches[top] };
+            branch.energy = std::numeric_limits<double>::infinity();
+            branch.visited = 0;
+            std::vector<std::vector<Stack>> stacks(layer_count + 1, std::vector<Stack>(pixel_count));
+            std::fill(stacks[0].begin(), stacks[0].end(), Stack{ { 0.0f, 0.0f, 0.0f }, 1.0f });
+            place(stacks[0], static_cast<int>(top), stacks[1]);
+            Order placed{ static_cast<int>(top) };
+            if (layer_count == 1) {
+                branch.energy = get_bound(stacks[0], static_cast<int>(top), 0);
+                branch.order = placed;
+                continue;
+            }
+            search(branch, stacks, placed, uint32_t{ 1 } << top);
+        }
+    });
+
+    // ties go to the first branch, so the result does not depend on the thread count
+    const Branch& best{ *std::min_element(branches.cbegin(), branches.cend(), [](const Branch& a, const Branch& b) {
+        return a.energy < b.energy;
+    }) };
+    visited = 0;
+    for (const Branch& branch : branches) {
+        visited += branch.visited;
+    }
+    best_energy = best.energy;
+    return { best.order.crbegin(), best.order.crend() };
+}
+
+size_t LayerOrderSearch::get_visited_nodes() const
+{
+    return visited;
+}
+
+double LayerOrderSearch::get_energy() const
+{
+    return best_energy;
+}
+
+void LayerOrderSearch::search(Branch& branch, std::vector<std::vector<Stack>>& stacks, Order& placed, uint32_t used)
+{
+    const std::vector<Stack>& stack{ stacks[placed.size()] };
+    std::vector<std::pair<double, int>> children;
+    for (size_t l{ 0 }; l < layer_count; ++l) {
+        if ((used & (uint32_t{ 1 } << l)) == 0) {
+            children.emplace_back(get_bound(stack, static_cast<int>(l), used), static_cast<int>(l));
+        }
+    }
+    branch.visited += children.size();
+    std::stable_sort(children.begin(), children.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    for (const auto& [bound, layer] : children) {
+        // a bound equal to the best is still searched so the first best order wins whatever the pruning
+        if (bound > best_energy.load(std::memory_order_relaxed)) {
+            break;
+        }
+        placed.push_back(layer);
+        if (placed.size() == layer_count) {
+            // with no layers left the bound is the error of the order
+            if (bound < branch.energy) {
+                branch.energy = bound;
+                branch.order = placed;
+                offer_energy(bound);
+            }
+        } else {
+            place(stack, layer, stacks[placed.size()]);
+            search(branch, stacks, placed, used | (uint32_t{ 1 } << layer));
+        }
+        placed.pop_back();
+    }
+}
+
+double LayerOrderSearch::get_bound(const std::vector<Stack>& stack, int layer, uint32_t used) const
+{
+    const uint32_t rest_mask{ ((uint32_t{ 1 } << layer_count) - 1) & ~used & ~(uint32_t{ 1 } << layer) };
+    // swapping neighbors i over j changes a channel by a_i * a_j * (c_i - c_j), so the layers left reach their least
+    // and greatest channel composite sorted by that channel, darkest and brightest on top respectively
+    std::array<std::vector<int>, 3> rest_darkest;
+    std::array<std::vector<int>, 3> rest_brightest;
+    for (size_t c{ 0 }; c < 3; ++c) {
+        for (const int l : darkest_layers[c]) {
+            if ((rest_mask & (uint32_t{ 1 } << l)) != 0) {
+                rest_darkest[c].push_back(l);
+            }
+        }
+        for (const int l : brightest_layers[c]) {
+            if ((rest_mask & (uint32_t{ 1 } << l)) != 0) {
+                rest_brightest[c].push_back(l);
+            }
+        }
+    }
+
+    const std::array<float, 4>* layer_pixel{ layer_pixels.data() + (layer * pixel_count) };
+    double bound{ 0.0 };
+    for (size_t p{ 0 }; p < pixel_count; ++p) {
+        const Stack& s{ stack[p] };
+        const std::array<float, 4>& lp{ layer_pixel[p] };
+        const float transmittance{ s.transmittance * (1.0f - lp[3]) };
+        Rgb low{ s.color[0] + (s.transmittance * lp[0]),
+                 s.color[1] + (s.transmittance * lp[1]),
+                 s.color[2] + (s.transmittance * lp[2]) };
+        Rgb high{ low };
+        float background_cover{ transmittance };
+        if ((rest_mask & pixel_coverage[p]) != 0) {
+            for (size_t c{ 0 }; c < 3; ++c) {
+                low[c] += transmittance * composite(rest_darkest[c], layer_color_min, c, p);
+                high[c] += transmittance * composite(rest_brightest[c], layer_color_max, c, p);
+            }
+            background_cover *= get_transmittance(rest_darkest[0], p);
+        }
+
+        float error{ 0.0f };
+        for (size_t c{ 0 }; c < 3; ++c) {
+            const float offset{ pixels[p].offset[c] - (background_cover * background[c]) };
+            const float d{ offset < low[c] ? low[c] - offset : (offset > high[c] ? offset - high[c] : 0.0f) };
+            error += d * d;
+        }
+        bound += pixels[p].weight * error;
+    }
+    return bound;
+}
+
+float LayerOrderSearch::composite(const std::vector<int>& layers,
+                                  const std::vector<Rgb>& colors,
+                                  size_t c,
+                                  size_t p) const
+{
+    float color{ 0.0f };
+    float transmittance{ 1.0f };
+    for (const int l : layers) {
+        const float a{ layer_pixels[(l * pixel_count) + p][3] };
+        color += transmittance * a * colors[l][c];
+        transmittance *= 1.0f - a;
+    }
+    return color;
+}
+
+float LayerOrderSearch::get_transmittance(const std::vector<int>& layers, size_t p) const
+{
+    float transmittance{ 1.0f };
+    for (const int l : layers) {
+        transmittance *= 1.0f - layer_pixels[(l * pixel_count) + p][3];
+    }
+    return transmittance;
+}
+
+void LayerOrderSearch::place(const std::vector<Stack>& stack, int layer, std::vector<Stack>& child) const
+{
+    const std::array<float, 4>* layer_pixel{ layer_pixels.data() + (layer * pixel_count) };
+    for (size_t p{ 0 }; p < pixel_count; ++p) {
+        const Stack& s{ stack[p] };
+        const std::array<float, 4>& lp{ layer_pixel[p] };
+        child[p] = { { s.color[0] + (s.transmittance * lp[0]),
+                       s.color[1] + (s.transmittance * lp[1]),
+                       s.color[2] + (s.transmittance * lp[2]) },
+                     s.transmittance * (1.0f - lp[3]) };
+    }
+}
+
+void LayerOrderSearch::offer_energy(double energy)
+{
+    double expected{ best_energy.load(std::memory_order_relaxed) };
+    while (energy < expected && !best_energy.compare_exchange_weak(expected, energy)) {
+    }
+}
@@ -1,4 +1,218 @@
 #include "logger.h"
 
-std::mutex Logger::mtx;
-auto Logger::start_time = std::chrono::steady_clock::now();
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Logger::Ring
+// written only by the thread that owns it and read only by the background thread
+class Logger::Ring
+{
+    static constexpr size_t CAPACITY{ 256 };
+
+    std::array<Record, CAPACITY> records;
+    alignas(64) std::atomic<size_t> head{ 0 }; // next record to print
+    alignas(64) std::atomic<size_t> tail{ 0 }; // next record to write
+    std::atomic<size_t> dropped{ 0 };
+
+public:
+    Record* try_acquire()
+    {
+        const size_t t{ tail.load(std::memory_order_relaxed) };
+        if (t - head.load(std::memory_order_acquire) == CAPACITY) {
+            return nullptr;
+        }
+        return &records[t % CAPACITY];
+    }
+
+    void publish() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    void drop() { dropped.fetch_add(1, std::memory_order_relaxed); }
+
+    [[nodiscard]] const Record* front() const
+    {
+        const size_t h{ head.load(std::memory_order_relaxed) };
+        return h == tail.load(std::memory_order_acquire) ? nullptr : &records[h % CAPACITY];
+    }
+
+    void clear_front() { records[head.load(std::memory_order_relaxed) % CAPACITY].long_text.clear(); }
+
+    void pop() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    size_t take_dropped() { return dropped.exchange(0, std::memory_order_relaxed); }
+};
+// Logger::Ring
+
+// Logger::Backend
+class Logger::Backend
+{
+    std::mutex rings_mutex; // only taken when a thread logs for the first time
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::atomic<size_t> ring_count{ 0 };
+    std::atomic<uint64_t> sequence{ 0 };
+    std::atomic<uint64_t> published{ 0 };
+    std::atomic<bool> sleeping{ false };
+    std::atomic<bool> stopping{ false };
+    uint64_t next_printed{ 0 }; // sequence of the next record to print, used by the background thread only
+    std::thread thread;
+
+public:
+    Backend()
+        : thread{ [this] { run(); } }
+    {
+    }
+
+    Backend(const Backend&) = delete;
+    Backend& operator=(const Backend&) = delete;
+
+    ~Backend()
+    {
+        stopping.store(true);
+        published.fetch_add(1);
+        published.notify_one();
+        thread.join();
+    }
+
+    static Backend& get()
+    {
+        static Backend backend;
+        return backend;
+    }
+
+    Ring& get_thread_ring()
+    {
+        thread_local Ring* ring{ nullptr };
+        if (ring == nullptr) {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            ring = rings.emplace_back(std::make_unique<Ring>()).get();
+            ring_count.fetch_add(1, std::memory_order_release);
+        }
+        return *ring;
+    }
+
+    uint64_t next_sequence() { return sequence.fetch_add(1, std::memory_order_relaxed); }
+
+    void wake()
+    {
+        // the background thread checks the rings again after announcing it sleeps, so it sees this record or count
+        published.fetch_add(1);
+        if (sleeping.load()) {
+            published.notify_one();
+        }
+    }
+
+private:
+    void run()
+    {
+        std::vector<Ring*> thread_rings;
+        while (true) {
+            drain(thread_rings);
+            if (stopping.load()) {
+                drain(thread_rings, true);
+                return;
+            }
+            sleeping.store(true);
+            const uint64_t seen{ published.load() };
+            if (!drain(thread_rings) && !stopping.load()) {
+                published.wait(seen);
+            }
+            sleeping.store(false);
+        }
+    }
+
+    // Prints the records of all rings in sequence order, returns whether any was printed.
+    // A thread takes its sequence number before formatting, so the next number may not be published yet while later
+    // ones are. Printing then stops until it is, a number is only taken once the ring has room so none goes missing.
+    // The last drain prints whatever is left
+    bool drain(std::vector<Ring*>& thread_rings, bool last = false)
+    {
+        if (ring_count.load(std::memory_order_acquire) != thread_rings.size()) {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            thread_rings.clear();
+            for (const std::unique_ptr<Ring>& ring : rings) {
+                thread_rings.push_back(ring.get());
+            }
+        }
+
+        bool printed{ false };
+        while (true) {
+            Ring* first{ nullptr };
+            for (Ring* ring : thread_rings) {
+                const Record* record{ ring->front() };
+                if (record != nullptr && (first == nullptr || record->sequence < first->front()->sequence)) {
+                    first = ring;
+                }
+            }
+            if (first == nullptr || (first->front()->sequence != next_printed && !last)) {
+                break;
+            }
+            next_printed = first->front()->sequence + 1;
+            Logger::print(*first->front());
+            first->clear_front();
+            first->pop();
+            printed = true;
+        }
+
+        for (Ring* ring : thread_rings) {
+            if (const size_t dropped{ ring->take_dropped() }; dropped > 0) {
+                Record record{ 0, 0, LogLevel::WARN, 0, {}, {} };
+                const auto elapsed{ std::chrono::steady_clock::now() - start_time };
+                record.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+                const auto result{ std::format_to_n(
+                    record.text.data(), record.text.size(), "Logger dropped {} messages, its ring was full", dropped) };
+                record.length = static_cast<uint16_t>(result.out - record.text.data());
+                Logger::print(record);
+                printed = true;
+            }
+        }
+        return printed;
+    }
+};
+// Logger::Backend
+
+// Logger
+const std::chrono::time_point<std::chrono::steady_clock> Logger::start_time{ std::chrono::steady_clock::now() };
+std::atomic<Logger::OverflowPolicy> Logger::overflow_policy{ Logger::OverflowPolicy::DROP };
+
+Logger::Record* Logger::acquire()
+{
+    Backend& backend{ Backend::get() };
+    Ring& ring{ backend.get_thread_ring() };
+    Record* record{ ring.try_acquire() };
+    while (record == nullptr) {
+        if (overflow_policy.load(std::memory_order_relaxed) == OverflowPolicy::DROP) {
+            ring.drop();
+            return nullptr;
+        }
+        backend.wake();
+        std::this_thread::yield();
+        record = ring.try_acquire();
+    }
+    record->sequence = backend.next_sequence();
+    return record;
+}
+
+void Logger::publish()
+{
+    Backend& backend{ Backend::get() };
+    backend.get_thread_ring().publish();
+    backend.wake();
+}
+
+void Logger::print(const Record& record)
+{
+    const int64_t elapsed_ms{ record.elapsed_ms };
+    const std::string_view text{ record.long_text.empty() ? std::string_view{ record.text.data(), record.length }
+                                                          : std::string_view{ record.long_text } };
+    const std::string line{ std::vformat(log_level_str(record.level), std::make_format_args(elapsed_ms, text)) };
+    std::println(record.level == LogLevel::ERROR ? stderr : stdout, "{}", line);
+}
+
+void Logger::set_overflow_policy(OverflowPolicy policy)
+{
+    overflow_policy.store(policy, std::memory_order_relaxed);
+}
+// Logger
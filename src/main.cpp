@@ -3,6 +3,7 @@
 #include "img.h"
 #include "img_color_quantizer.h"
 #include "logger.h"
+#include "planar_img.h"
 #include "string_art_solver.h"
 #include "thread_pool.h"
 #include "vec.h"
@@ -55,7 +56,7 @@ int main(int argc, char* argv[])
         }
 
         Logger::info("Loading image: {}", pic_filename);
-        Img pic{ Img::load(pic_filename) };
+        PlanarImg pic{ PlanarImg::load(pic_filename, PlanarImg::Precision::U8) };
 
         ThreadPool tp;
 
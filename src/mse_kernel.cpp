@@ -0,0 +1,207 @@
+#include "mse_kernel.h"
+#include "string_solver.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+using residual_t = StringSolver::residual_t;
+
+constexpr int HEADROOM_BITS{ StringSolver::RESIDUAL_HEADROOM_BITS };
+constexpr int HEADROOM_MAX{ StringSolver::RESIDUAL_HEADROOM_MAX };
+
+// |a * (a - 2r)| < 2^16 per pixel, so 32-bit lanes are flushed to 64 bits well before they can overflow
+constexpr size_t FLUSH_INTERVAL{ size_t{ 1 } << 14 };
+
+// drawing adds a = min(s, max - current) to a pixel, so its squared error changes by (a - r)^2 - r^2 = a * (a - 2r).
+// Drawing d more over the pixel first takes a * (a - 2r + 2d), then x * (2 * (max - target) - x) once the headroom x
+// drops below s. Neither goes under min(0, a * (a - 2r)), so summing that bounds every later delta from below
+MseDelta scalar_range(const FootprintCache::Footprint& footprint, const residual_t* residual, size_t begin, size_t end)
+{
+    MseDelta sum{ 0, 0 };
+    for (size_t i{ begin }; i < end; ++i) {
+        assert(footprint.intensities[i] <= HEADROOM_MAX);
+        const int32_t word{ residual[footprint.pixels[i]] };
+        const int32_t r{ word >> HEADROOM_BITS };
+        const int32_t a{ std::min(static_cast<int32_t>(footprint.intensities[i]), word & HEADROOM_MAX) };
+        const int32_t delta{ a * (a - 2 * r) };
+        sum.delta += delta;
+        sum.lower_bound += std::min(0, delta);
+    }
+    return sum;
+}
+
+MseDelta operator+(const MseDelta& lhs, const MseDelta& rhs)
+{
+    return { lhs.delta + rhs.delta, lhs.lower_bound + rhs.lower_bound };
+}
+
+using Kernel = MseDelta (*)(const FootprintCache::Footprint&, const residual_t*);
+
+struct KernelChoice
+{
+    Kernel kernel;
+    const char* isa;
+};
+
+// every kernel the cpu can run, fastest first
+std::vector<KernelChoice> supported_kernels()
+{
+    std::vector<KernelChoice> kernels;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({ footprint_mse_delta_avx2, "avx2" });
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        kernels.push_back({ footprint_mse_delta_sse41, "sse4.1" });
+    }
+#endif
+    kernels.push_back({ footprint_mse_delta_scalar, "scalar" });
+    return kernels;
+}
+
+// Self-test of every kernel against the scalar one on random residuals, long enough to flush the vector lanes
+// and leave a scalar tail
+[[maybe_unused]] bool kernels_agree(const std::vector<KernelChoice>& kernels)
+{
+    constexpr size_t PIXEL_COUNT{ (FLUSH_INTERVAL * 8) + 13 };
+    std::minstd_rand rng{ 1 };
+    std::uniform_int_distribution<int> pixel_value{ 0, std::numeric_limits<StringSolver::pixel_t>::max() };
+    std::uniform_int_distribution<int> intensity{ 0, HEADROOM_MAX };
+    // one element of padding, as the vector paths expect
+    std::vector<residual_t> residual(PIXEL_COUNT + 1);
+    std::vector<uint32_t> pixels(PIXEL_COUNT);
+    std::vector<uint8_t> intensities(PIXEL_COUNT);
+    for (size_t i{ 0 }; i < PIXEL_COUNT; ++i) {
+        residual[i] = StringSolver::make_residual(static_cast<StringSolver::pixel_t>(pixel_value(rng)),
+                                                  static_cast<StringSolver::pixel_t>(pixel_value(rng)));
+        pixels[i] = static_cast<uint32_t>((i * 7919) % PIXEL_COUNT);
+        intensities[i] = static_cast<uint8_t>(intensity(rng));
+    }
+    const FootprintCache::Footprint footprint{ pixels, intensities };
+    const MseDelta expected{ footprint_mse_delta_scalar(footprint, residual.data()) };
+    return std::ranges::all_of(kernels, [&](const KernelChoice& choice) {
+        const MseDelta sum{ choice.kernel(footprint, residual.data()) };
+        return sum.delta == expected.delta && sum.lower_bound == expected.lower_bound;
+    });
+}
+
+KernelChoice choose_kernel()
+{
+    const std::vector<KernelChoice> kernels{ supported_kernels() };
+    assert(kernels_agree(kernels));
+    return kernels.front();
+}
+
+const KernelChoice& get_kernel()
+{
+    static const KernelChoice choice{ choose_kernel() };
+    return choice;
+}
+}
+
+MseDelta footprint_mse_delta(const FootprintCache::Footprint& footprint, const residual_t* residual)
+{
+    return get_kernel().kernel(footprint, residual);
+}
+
+const char* footprint_mse_delta_isa()
+{
+    return get_kernel().isa;
+}
+
+MseDelta footprint_mse_delta_scalar(const FootprintCache::Footprint& footprint, const residual_t* residual)
+{
+    return scalar_range(footprint, residual, 0, footprint.pixels.size());
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.1"))) MseDelta footprint_mse_delta_sse41(const FootprintCache::Footprint& footprint,
+                                                                      const residual_t* residual)
+{
+    const size_t n{ footprint.pixels.size() };
+    const uint32_t* pixels{ footprint.pixels.data() };
+    const uint8_t* intensities{ footprint.intensities.data() };
+    const __m128i headroom_mask{ _mm_set1_epi32(HEADROOM_MAX) };
+    const __m128i zero{ _mm_setzero_si128() };
+
+    MseDelta sum{ 0, 0 };
+    size_t i{ 0 };
+    while (i + 4 <= n) {
+        const size_t block_end{ std::min(n - (n - i) % 4, i + FLUSH_INTERVAL * 4) };
+        __m128i acc{ _mm_setzero_si128() };
+        __m128i bound_acc{ _mm_setzero_si128() };
+        for (; i < block_end; i += 4) {
+            const __m128i words{ _mm_set_epi32(residual[pixels[i + 3]],
+                                               residual[pixels[i + 2]],
+                                               residual[pixels[i + 1]],
+                                               residual[pixels[i]]) };
+            const __m128i r{ _mm_srai_epi32(words, HEADROOM_BITS) };
+            int32_t s4;
+            std::copy_n(intensities + i, 4, reinterpret_cast<uint8_t*>(&s4));
+            const __m128i s{ _mm_cvtepu8_epi32(_mm_cvtsi32_si128(s4)) };
+            const __m128i a{ _mm_min_epi32(s, _mm_and_si128(words, headroom_mask)) };
+            const __m128i delta{ _mm_mullo_epi32(a, _mm_sub_epi32(a, _mm_slli_epi32(r, 1))) };
+            acc = _mm_add_epi32(acc, delta);
+            bound_acc = _mm_add_epi32(bound_acc, _mm_min_epi32(delta, zero));
+        }
+        alignas(16) int32_t lanes[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+        sum.delta += static_cast<int64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), bound_acc);
+        sum.lower_bound += static_cast<int64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+    return sum + scalar_range(footprint, residual, i, n);
+}
+
+__attribute__((target("avx2"))) MseDelta footprint_mse_delta_avx2(const FootprintCache::Footprint& footprint,
+                                                                   const residual_t* residual)
+{
+    const size_t n{ footprint.pixels.size() };
+    const uint32_t* pixels{ footprint.pixels.data() };
+    const uint8_t* intensities{ footprint.intensities.data() };
+    const int* residual_base{ reinterpret_cast<const int*>(residual) };
+    const __m256i headroom_mask{ _mm256_set1_epi32(HEADROOM_MAX) };
+    const __m256i zero{ _mm256_setzero_si256() };
+
+    MseDelta sum{ 0, 0 };
+    size_t i{ 0 };
+    while (i + 8 <= n) {
+        const size_t block_end{ std::min(n - (n - i) % 8, i + FLUSH_INTERVAL * 8) };
+        __m256i acc{ _mm256_setzero_si256() };
+        __m256i bound_acc{ _mm256_setzero_si256() };
+        for (; i < block_end; i += 8) {
+            const __m256i index{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i)) };
+            // 32-bit gather at 16-bit stride, the wanted word is the low half of each lane
+            const __m256i gathered{ _mm256_i32gather_epi32(residual_base, index, sizeof(residual_t)) };
+            const __m256i words{ _mm256_srai_epi32(_mm256_slli_epi32(gathered, 16), 16) };
+            const __m256i r{ _mm256_srai_epi32(words, HEADROOM_BITS) };
+            const __m256i s{ _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(intensities + i))) };
+            const __m256i a{ _mm256_min_epi32(s, _mm256_and_si256(words, headroom_mask)) };
+            const __m256i delta{ _mm256_mullo_epi32(a, _mm256_sub_epi32(a, _mm256_slli_epi32(r, 1))) };
+            acc = _mm256_add_epi32(acc, delta);
+            bound_acc = _mm256_add_epi32(bound_acc, _mm256_min_epi32(delta, zero));
+        }
+        alignas(32) int32_t lanes[8];
+        alignas(32) int32_t bound_lanes[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(bound_lanes), bound_acc);
+        for (size_t lane{ 0 }; lane < 8; ++lane) {
+            sum.delta += lanes[lane];
+            sum.lower_bound += bound_lanes[lane];
+        }
+    }
+    return sum + scalar_range(footprint, residual, i, n);
+}
+#endif
@@ -0,0 +1,244 @@
+#include "planar_img.h"
+#include "color.h"
+#include "img.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+namespace {
+// round to nearest even, too large values become infinity
+uint16_t to_half(float value)
+{
+    const uint32_t bits{ std::bit_cast<uint32_t>(value) };
+    const uint16_t sign{ static_cast<uint16_t>((bits >> 16) & 0x8000) };
+    const float magnitude{ std::fabs(value) };
+    if (std::isnan(value)) {
+        return sign | 0x7E00;
+    }
+    if (magnitude >= 65520.0f) {
+        return sign | 0x7C00;
+    }
+    if (magnitude < 0x1p-14f) {
+        return sign | static_cast<uint16_t>(std::lrint(magnitude * 0x1p24f));
+    }
+    uint32_t half{ ((((bits >> 23) & 0xFF) - 112) << 10) | ((bits & 0x7FFFFF) >> 13) };
+    const uint32_t rest{ bits & 0x1FFF };
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1) != 0)) {
+        ++half;
+    }
+    return sign | static_cast<uint16_t>(half);
+}
+
+float from_half(uint16_t half)
+{
+    const uint32_t sign{ static_cast<uint32_t>(half & 0x8000) << 16 };
+    const uint32_t exponent{ (half >> 10) & 0x1Fu };
+    const uint32_t mantissa{ half & 0x3FFu };
+    if (exponent == 0) {
+        const float magnitude{ static_cast<float>(mantissa) * 0x1p-24f };
+        return sign != 0 ? -magnitude : magnitude;
+    }
+    if (exponent == 0x1F) {
+        return std::bit_cast<float>(sign | 0x7F800000 | (mantissa << 13));
+    }
+    return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+uint8_t to_u8(float value)
+{
+    return static_cast<uint8_t>((std::clamp(value, 0.0f, 1.0f) * 255.0f) + 0.5f);
+}
+} // namespace
+
+// PlanarImg
+PlanarImg::PlanarImg(size_t w, size_t h, Precision precision)
+    : w{ w }
+    , h{ h }
+    , precision{ precision }
+    , row_lines{ ((w * get_channel_size(precision)) + ALIGNMENT - 1) / ALIGNMENT }
+    , lines(Color::CHANNELS * h * row_lines, CacheLine{})
+{
+}
+
+PlanarImg::PlanarImg(const Img& img, Precision precision)
+    : PlanarImg{ img.get_w(), img.get_h(), precision }
+{
+    std::vector<float> values(w);
+    for (size_t y{ 0 }; y < h; ++y) {
+        const Color* img_row{ img.data() + (y * w) };
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            for (size_t x{ 0 }; x < w; ++x) {
+                values[x] = img_row[x][c];
+            }
+            store_row(c, y, values.data());
+        }
+    }
+}
+
+PlanarImg PlanarImg::load(const std::string& path, Precision precision)
+{
+    int w, h, n;
+    uint8_t* data = stbi_load(path.c_str(), &w, &h, &n, Color::CHANNELS);
+    if (data == nullptr) {
+        throw "failed to load image";
+    }
+    PlanarImg img{ static_cast<size_t>(w), static_cast<size_t>(h), precision };
+    std::vector<float> values(img.w);
+    for (size_t y{ 0 }; y < img.h; ++y) {
+        const uint8_t* data_row{ data + (y * img.w * Color::CHANNELS) };
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            if (precision == Precision::U8) {
+                uint8_t* out{ img.row<uint8_t>(c, y) };
+                for (size_t x{ 0 }; x < img.w; ++x) {
+                    out[x] = data_row[(x * Color::CHANNELS) + c];
+                }
+                continue;
+            }
+            for (size_t x{ 0 }; x < img.w; ++x) {
+                values[x] = static_cast<float>(data_row[(x * Color::CHANNELS) + c]) / 255.f;
+            }
+            img.store_row(c, y, values.data());
+        }
+    }
+    stbi_image_free(data);
+    return img;
+}
+
+Img PlanarImg::to_img() const
+{
+    Img img{ w, h };
+    std::array<std::vector<float>, Color::CHANNELS> values;
+    for (std::vector<float>& channel : values) {
+        channel.resize(w);
+    }
+    for (size_t y{ 0 }; y < h; ++y) {
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            load_row(c, y, values[c].data());
+        }
+        Color* img_row{ img.data() + (y * w) };
+        for (size_t x{ 0 }; x < w; ++x) {
+            img_row[x] = Color{ values[0][x], values[1][x], values[2][x], values[3][x] };
+        }
+    }
+    return img;
+}
+
+size_t PlanarImg::get_w() const
+{
+    return w;
+}
+
+size_t PlanarImg::get_h() const
+{
+    return h;
+}
+
+size_t PlanarImg::size() const
+{
+    return w * h;
+}
+
+PlanarImg::Precision PlanarImg::get_precision() const
+{
+    return precision;
+}
+
+size_t PlanarImg::get_channel_size(Precision precision)
+{
+    switch (precision) {
+        case Precision::U8:
+            return sizeof(uint8_t);
+        case Precision::F16:
+            return sizeof(uint16_t);
+        case Precision::F32:
+            return sizeof(float);
+    }
+    std::unreachable();
+}
+
+void PlanarImg::load_row(size_t channel, size_t y, float* out) const
+{
+    switch (precision) {
+        case Precision::U8: {
+            const uint8_t* in{ row<uint8_t>(channel, y) };
+            for (size_t x{ 0 }; x < w; ++x) {
+                out[x] = static_cast<float>(in[x]) / 255.f;
+            }
+            break;
+        }
+        case Precision::F16: {
+            const uint16_t* in{ row<uint16_t>(channel, y) };
+            std::transform(in, in + w, out, from_half);
+            break;
+        }
+        case Precision::F32: {
+            const float* in{ row<float>(channel, y) };
+            std::copy(in, in + w, out);
+            break;
+        }
+    }
+}
+
+void PlanarImg::store_row(size_t channel, size_t y, const float* in)
+{
+    switch (precision) {
+        case Precision::U8:
+            std::transform(in, in + w, row<uint8_t>(channel, y), to_u8);
+            break;
+        case Precision::F16:
+            std::transform(in, in + w, row<uint16_t>(channel, y), to_half);
+            break;
+        case Precision::F32:
+            std::copy(in, in + w, row<float>(channel, y));
+            break;
+    }
+}
+
+Color PlanarImg::get(size_t x, size_t y) const
+{
+    assert(x < w && y < h);
+    std::array<float, Color::CHANNELS> values;
+    for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+        switch (precision) {
+            case Precision::U8:
+                values[c] = static_cast<float>(row<uint8_t>(c, y)[x]) / 255.f;
+                break;
+            case Precision::F16:
+                values[c] = from_half(row<uint16_t>(c, y)[x]);
+                break;
+            case Precision::F32:
+                values[c] = row<float>(c, y)[x];
+                break;
+        }
+    }
+    return Color{ values[0], values[1], values[2], values[3] };
+}
+
+void PlanarImg::set(size_t x, size_t y, const Color& color)
+{
+    assert(x < w && y < h);
+    for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+        switch (precision) {
+            case Precision::U8:
+                row<uint8_t>(c, y)[x] = to_u8(color[c]);
+                break;
+            case Precision::F16:
+                row<uint16_t>(c, y)[x] = to_half(color[c]);
+                break;
+            case Precision::F32:
+                row<float>(c, y)[x] = color[c];
+                break;
+        }
+    }
+}
+
+const std::byte* PlanarImg::row_bytes(size_t channel, size_t y) const
+{
+    assert(channel < Color::CHANNELS && y < h);
+    return lines[(((channel * h) + y) * row_lines)].bytes.data();
+}
+// PlanarImg
@@ -1,22 +1,27 @@
 #include "string_art_solver.h"
 #include "annealing_optimizer.h"
 #include "color.h"
+#include "layer_compositor.h"
+#include "layer_order_search.h"
 #include "logger.h"
+#include "mse_kernel.h"
 #include "string_color_solver.h"
 #include "string_sequence.h"
 #include "thread_rng.h"
 #include "vec.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <format>
 #include <functional>
 #include <memory>
 #include <numbers>
+#include <random>
 #include <utility>
 #include <vector>
 
-StringArtSolver::StringArtSolver(Img&& target_img,
+StringArtSolver::StringArtSolver(PlanarImg&& target_img,
                                  std::vector<Color>&& palette,
                                  Color background_color,
                                  double img_diameter_cm,
@@ -24,6 +29,9 @@ StringArtSolver::StringArtSolver(Img&& target_img,
                                  double nail_diameter_cm,
                                  double nail_img_dist_cm,
                                  double string_diameter_cm,
+                                 StringColorSolver::ScoringMode scoring_mode,
+                                 StringColorSolver::PyramidSettings pyramid_settings,
+                                 uint32_t rearrange_chains,
                                  ThreadPool& thread_pool)
     : target_img{ std::move(target_img) }
     , palette{ std::move(palette) }
@@ -31,6 +39,9 @@ StringArtSolver::StringArtSolver(Img&& target_img,
     , img_scale{ static_cast<double>(target_img.get_w()) / img_diameter_cm }
     , nail_radius{ nail_diameter_cm / 2.0 * img_scale }
     , string_radius{ string_diameter_cm / 2.0 * img_scale }
+    , scoring_mode{ scoring_mode }
+    , pyramid_settings{ pyramid_settings }
+    , rearrange_chains{ rearrange_chains }
     , thread_pool{ thread_pool }
     , nail_positions{ make_nail_positions(Vec2<double>(this->target_img.get_w(), this->target_img.get_h()) / 2.0,
                                           (img_diameter_cm / 2.0 + nail_img_dist_cm) * img_scale,
@@ -40,7 +51,40 @@ StringArtSolver::StringArtSolver(Img&& target_img,
 
 void StringArtSolver::solve()
 {
-    std::vector<ColorSolverResult> color_solver_results = solve_colors();
+    if (!footprint_cache) {
+        Logger::info("Rasterizing string footprints, scoring kernel: {}", footprint_mse_delta_isa());
+        footprint_cache = std::make_unique<FootprintCache>(
+            target_img.get_w(), target_img.get_h(), nail_positions, nail_radius, string_radius, thread_pool);
+    }
+
+    // incremental scoring pays off when a drawn string crosses fewer chords than are rescored each step,
+    // the pyramid only narrows full scoring down to a shortlist
+    StringColorSolver::ScoringMode color_scoring_mode{ scoring_mode };
+    if (color_scoring_mode == StringColorSolver::ScoringMode::AUTO && pyramid_settings.levels > 1) {
+        color_scoring_mode = StringColorSolver::ScoringMode::FULL;
+    } else if (color_scoring_mode == StringColorSolver::ScoringMode::AUTO) {
+        const double candidates_per_step{ 2.0 * static_cast<double>(nail_positions.size() - 1) };
+        color_scoring_mode = footprint_cache->get_chord_overlap() < candidates_per_step
+                                 ? StringColorSolver::ScoringMode::INCREMENTAL
+                                 : StringColorSolver::ScoringMode::FULL;
+    }
+    if (color_scoring_mode == StringColorSolver::ScoringMode::INCREMENTAL) {
+        Logger::info("Indexing string footprints for incremental scoring");
+        footprint_cache->build_pixel_index();
+    } else {
+        Logger::info("Indexing string footprints for candidate pruning");
+        footprint_cache->build_coarse_index(thread_pool);
+        if (pyramid_footprint_caches.size() + 1 < pyramid_settings.levels) {
+            Logger::info("Downsampling string footprints for {} pyramid levels", pyramid_settings.levels);
+            while (pyramid_footprint_caches.size() + 1 < pyramid_settings.levels) {
+                const FootprintCache& finer{ pyramid_footprint_caches.empty() ? *footprint_cache
+                                                                               : *pyramid_footprint_caches.back() };
+                pyramid_footprint_caches.push_back(std::make_unique<FootprintCache>(finer, 2, thread_pool));
+            }
+        }
+    }
+
+    std::vector<ColorSolverResult> color_solver_results = solve_colors(color_scoring_mode);
     if (color_solver_results.size() > 1) {
         rearrange_colors(color_solver_results);
     }
@@ -74,28 +118,30 @@ double StringArtSolver::get_nail_radius_px() const
     return nail_radius;
 }
 
-std::vector<StringArtSolver::ColorSolverResult> StringArtSolver::solve_colors()
+std::vector<StringArtSolver::ColorSolverResult> StringArtSolver::solve_colors(
+    StringColorSolver::ScoringMode color_scoring_mode)
 {
-    ThreadPool solver_thread_pool(4);
-    std::function<ColorSolverResult(Color)> f = [this](Color color) -> ColorSolverResult {
+    // colors run on the same pool as their candidate batches, a color waiting for its batches keeps the worker busy
+    auto f = [this, color_scoring_mode](Color color) -> ColorSolverResult {
         Logger::info(
             "Solving for color: ( {:.0f}, {:.0f}, {:.0f} )", 255 * color.r(), 255 * color.g(), 255 * color.b());
-        StringColorSolver solver{ target_img, background_color, nail_positions, nail_radius, string_radius,
-                                  color,      thread_pool };
+        StringColorSolver solver{ target_img, background_color,   nail_positions, nail_radius, string_radius,
+                                  color,      *footprint_cache, color_scoring_mode, pyramid_footprint_caches,
+                                  pyramid_settings, thread_pool };
         solver.solve();
         return { color, std::move(solver.get_sequence()), std::move(solver.get_img()) };
     };
 
-    std::vector<std::future<ColorSolverResult>> futures;
+    std::vector<ThreadPool::Future<ColorSolverResult>> futures;
     futures.reserve(palette.size());
     for (const Color& color : palette) {
-        futures.push_back(solver_thread_pool.submit(0, f, color));
+        futures.push_back(thread_pool.submit(0, f, color));
     }
 
     std::vector<ColorSolverResult> results;
     results.reserve(futures.size());
     for (auto& f : futures) {
-        results.push_back(f.get());
+        results.push_back(thread_pool.wait(f));
     }
 
     return results;
@@ -105,84 +151,106 @@ void StringArtSolver::rearrange_colors(std::vector<ColorSolverResult>& color_sol
 {
     Logger::info("Rearranging colors");
 
-    using Solution = std::vector<int>;
+    if (color_solver_results.size() <= EXACT_REARRANGE_MAX_COLORS) {
+        rearrange_colors_exact(color_solver_results);
+        return;
+    }
+
+    // layer order with its Zobrist hash, the xor of a random key per (position, layer) pair,
+    // so a swap updates the hash from the four keys involved instead of rehashing the whole order
+    struct Solution
+    {
+        std::vector<int> order;
+        uint64_t hash;
+
+        bool operator==(const Solution& other) const { return hash == other.hash && order == other.order; }
+    };
     using NeighborFunc = std::function<Solution(const Solution&)>;
-    using EnergyFunc = std::function<double(const Solution&)>;
+    using EnergyFunc = std::function<double(const Solution&, size_t)>;
 
     struct SolutionHash
     {
-        size_t operator()(const Solution& solution) const
-        {
-            size_t hash{ 0 };
-            for (int i : solution) {
-                hash ^= std::hash<int>{}(i) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-            }
-            return hash;
-        }
+        size_t operator()(const Solution& solution) const { return solution.hash; }
     };
 
-    NeighborFunc neighbor_func = [](const Solution& solution) -> Solution {
+    const size_t n{ color_solver_results.size() };
+    std::vector<uint64_t> zobrist_keys(n * n);
+    std::mt19937_64 zobrist_rng{ n };
+    std::generate(zobrist_keys.begin(), zobrist_keys.end(), std::ref(zobrist_rng));
+    auto zobrist_key = [&zobrist_keys, n](size_t position, int layer) { return zobrist_keys[(position * n) + layer]; };
+
+    NeighborFunc neighbor_func = [&zobrist_key](const Solution& solution) -> Solution {
         Solution neighbor = solution;
-        const int max = static_cast<int>(neighbor.size() - 1);
+        const int max = static_cast<int>(neighbor.order.size() - 1);
         const int a = ThreadRng::uniform_int(0, max);
         const int b = ThreadRng::uniform_int(0, max);
-        std::swap(neighbor[a], neighbor[b]);
+        neighbor.hash ^= zobrist_key(a, neighbor.order[a]) ^ zobrist_key(b, neighbor.order[b]);
+        std::swap(neighbor.order[a], neighbor.order[b]);
+        neighbor.hash ^= zobrist_key(a, neighbor.order[a]) ^ zobrist_key(b, neighbor.order[b]);
         return neighbor;
     };
 
-    EnergyFunc energy_func = [this, &color_solver_results](const Solution& solution) -> double {
-        std::function<double(Img::ConstRegion region)> f =
-            [this, &color_solver_results, solution](Img::ConstRegion target_img_region) {
-                double mse{ 0.0 };
-                std::for_each(target_img_region.cbegin(), target_img_region.cend(), [&](const auto& target) {
-                    Color color = background_color;
-                    for (int i : solution) {
-                        const Img& result_img{ *color_solver_results[i].img };
-                        color += result_img(target.get_x(), target.get_y());
-                    }
-
-                    const Color diff{ *target - color };
-                    mse += diff.r() * diff.r() + diff.g() * diff.g() + diff.b() * diff.b();
-                });
-                return mse;
-            };
-
-        const uint32_t n_tasks{ thread_pool.get_n_threads() * 64 };
-        const size_t rows_per_task{ target_img.get_h() / n_tasks > 0 ? target_img.get_h() / n_tasks : 1 };
-
-        std::vector<std::future<double>> futures;
-        futures.reserve(n_tasks);
-        for (size_t y_start{ 0 }; y_start < target_img.get_h(); y_start += rows_per_task) {
-            size_t y_end{ std::min(y_start + rows_per_task, target_img.get_h()) };
-            futures.push_back(thread_pool.submit(1, f, target_img.get_cregion(0, y_start, target_img.get_w(), y_end)));
-        }
-
-        double mse{ 0.0 };
-        for (auto& f : futures) {
-            mse += f.get();
-        }
+    std::vector<const Img*> layers;
+    layers.reserve(color_solver_results.size());
+    for (const ColorSolverResult& result : color_solver_results) {
+        layers.push_back(result.img.get());
+    }
+    const LayerCompositor::Coverage coverage{ target_img, layers, thread_pool };
+    // each chain keeps its own last evaluated order
+    std::vector<std::unique_ptr<LayerCompositor>> compositors;
+    for (uint32_t i{ 0 }; i < rearrange_chains; ++i) {
+        compositors.push_back(std::make_unique<LayerCompositor>(background_color, coverage, thread_pool));
+    }
 
-        return mse;
+    EnergyFunc energy_func = [&compositors](const Solution& solution, size_t chain_id) -> double {
+        return compositors[chain_id]->evaluate(solution.order);
     };
 
     const double initial_temp{ 100.0 };
     const double cooling_rate{ 0.99 };
     const int max_iter{ 500 };
+    const double max_temp_ratio{ 10.0 };
+    const int exchange_interval{ 10 };
+    const size_t memo_capacity{ size_t{ 1 } << 16 };
 
     AnnealingOptimizer<Solution, SolutionHash> optimizer{
-        neighbor_func, energy_func, initial_temp, cooling_rate, max_iter
+        neighbor_func, energy_func, initial_temp, cooling_rate, max_iter, memo_capacity
     };
 
-    Solution initial_solution;
+    Solution initial_solution{ {}, 0 };
     for (int i = 0; i < color_solver_results.size(); ++i) {
-        initial_solution.push_back(i);
+        initial_solution.order.push_back(i);
+        initial_solution.hash ^= zobrist_key(i, i);
     }
 
-    Solution optimized_solution = optimizer.optimize(initial_solution);
+    Solution optimized_solution = optimizer.optimize(
+        initial_solution, thread_pool, { rearrange_chains, max_temp_ratio, exchange_interval });
+
+    std::vector<ColorSolverResult> rearranged_results;
+    rearranged_results.reserve(color_solver_results.size());
+    for (int i : optimized_solution.order) {
+        rearranged_results.push_back(std::move(color_solver_results[i]));
+    }
+    color_solver_results = std::move(rearranged_results);
+}
+
+void StringArtSolver::rearrange_colors_exact(std::vector<ColorSolverResult>& color_solver_results)
+{
+    const size_t max_search_side{ 64 };
+    const size_t factor{ (std::max(target_img.get_w(), target_img.get_h()) + max_search_side - 1) / max_search_side };
+
+    std::vector<const Img*> layers;
+    layers.reserve(color_solver_results.size());
+    for (const ColorSolverResult& result : color_solver_results) {
+        layers.push_back(result.img.get());
+    }
+    LayerOrderSearch search{ target_img, background_color, layers, factor, thread_pool };
+    const LayerOrderSearch::Order order{ search.solve() };
+    Logger::info("Exact order search: {} nodes, Energy: {:.2f}", search.get_visited_nodes(), search.get_energy());
 
     std::vector<ColorSolverResult> rearranged_results;
     rearranged_results.reserve(color_solver_results.size());
-    for (int i : optimized_solution) {
+    for (int i : order) {
         rearranged_results.push_back(std::move(color_solver_results[i]));
     }
     color_solver_results = std::move(rearranged_results);
@@ -1,6 +1,10 @@
 #include "img.h"
+#include "planar_img.h"
 #include "string_art_solver.h"
 
+#include <algorithm>
+#include <cstddef>
+
 StringArtSolver::Builder::Builder()
     : background_color{ 1.0, 1.0, 1.0 } // default values
     , img_diameter_cm{ 0.0 }
@@ -8,6 +12,9 @@ StringArtSolver::Builder::Builder()
     , nail_diameter_cm{ 0.15 }
     , nail_img_dist_cm{ 1.0 }
     , string_diameter_cm{ 0.05 }
+    , scoring_mode{ StringColorSolver::ScoringMode::AUTO }
+    , pyramid_settings{ 1, 16, 0 }
+    , rearrange_chains{ 1 }
     , thread_pool{ std::nullopt }
 {
 }
@@ -41,14 +48,34 @@ StringArtSolver StringArtSolver::Builder::build()
     if (string_diameter_cm >= img_diameter_cm) {
         throw std::invalid_argument("string diameter must be less than image diameter");
     }
+    if (pyramid_settings.levels <= 0) {
+        throw std::invalid_argument("pyramid levels must be greater than 0");
+    }
+    if (pyramid_settings.levels > 16 ||
+        (size_t{ 1 } << (pyramid_settings.levels - 1)) >= std::min(target_img.get_w(), target_img.get_h())) {
+        throw std::invalid_argument("pyramid levels must leave the coarsest level larger than 1 pixel");
+    }
+    if (pyramid_settings.shortlist_size <= 0) {
+        throw std::invalid_argument("pyramid shortlist size must be greater than 0");
+    }
+    if (rearrange_chains <= 0) {
+        throw std::invalid_argument("rearrange chains must be greater than 0");
+    }
     if (!thread_pool.has_value()) {
         throw std::invalid_argument("thread pool is not set");
     }
-    return { std::move(target_img), std::move(palette), background_color,   img_diameter_cm,          nail_count,
-             nail_diameter_cm,      nail_img_dist_cm,   string_diameter_cm, thread_pool.value().get() };
+    return { std::move(target_img), std::move(palette), background_color,   img_diameter_cm,  nail_count,
+             nail_diameter_cm,      nail_img_dist_cm,   string_diameter_cm, scoring_mode,     pyramid_settings,
+             rearrange_chains,      thread_pool.value().get() };
 }
 
 StringArtSolver::Builder& StringArtSolver::Builder::set_target_img(Img&& target_img)
+{
+    this->target_img = PlanarImg{ target_img, PlanarImg::Precision::F32 };
+    return *this;
+}
+
+StringArtSolver::Builder& StringArtSolver::Builder::set_target_img(PlanarImg&& target_img)
 {
     this->target_img = std::move(target_img);
     return *this;
@@ -96,6 +123,36 @@ StringArtSolver::Builder& StringArtSolver::Builder::set_string_diameter_cm(doubl
     return *this;
 }
 
+StringArtSolver::Builder& StringArtSolver::Builder::set_scoring_mode(StringColorSolver::ScoringMode mode)
+{
+    this->scoring_mode = mode;
+    return *this;
+}
+
+StringArtSolver::Builder& StringArtSolver::Builder::set_pyramid_levels(uint32_t levels)
+{
+    this->pyramid_settings.levels = levels;
+    return *this;
+}
+
+StringArtSolver::Builder& StringArtSolver::Builder::set_pyramid_shortlist_size(uint32_t size)
+{
+    this->pyramid_settings.shortlist_size = size;
+    return *this;
+}
+
+StringArtSolver::Builder& StringArtSolver::Builder::set_pyramid_coarse_steps(uint32_t steps)
+{
+    this->pyramid_settings.coarse_steps = steps;
+    return *this;
+}
+
+StringArtSolver::Builder& StringArtSolver::Builder::set_rearrange_chains(uint32_t chains)
+{
+    this->rearrange_chains = chains;
+    return *this;
+}
+
 StringArtSolver::Builder& StringArtSolver::Builder::set_thread_pool(ThreadPool& thread_pool)
 {
     this->thread_pool = std::make_optional(std::ref(thread_pool));
@@ -1,53 +1,179 @@
 #include "string_color_solver.h"
+#include "chord_gain_tracker.h"
 #include "img.h"
 #include "logger.h"
+#include "mse_kernel.h"
+#include "planar_img.h"
 #include "string_line.h"
 #include "string_solver.h"
 #include "vec.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
 #include <cstdint>
-#include <functional>
 #include <iterator>
 #include <limits>
 #include <memory>
+#include <numeric>
+#include <optional>
+#include <utility>
 #include <vector>
 
-StringColorSolver::StringColorSolver(const Img& full_img,
+namespace {
+StringSolver::pixel_t block_average(const Array2d<StringSolver::pixel_t>& img, size_t factor, size_t x, size_t y)
+{
+    uint32_t sum{ 0 };
+    uint32_t count{ 0 };
+    for (size_t img_y{ y * factor }; img_y < std::min(img.get_h(), (y + 1) * factor); ++img_y) {
+        for (size_t img_x{ x * factor }; img_x < std::min(img.get_w(), (x + 1) * factor); ++img_x) {
+            sum += img(img_x, img_y);
+            ++count;
+        }
+    }
+    return static_cast<StringSolver::pixel_t>((sum + (count / 2)) / count);
+}
+}
+
+StringColorSolver::StringColorSolver(const PlanarImg& full_img,
                                      const Color& background_color,
                                      const std::vector<Vec2<double>>& nail_positions,
                                      const double nail_radius,
                                      const double string_radius,
                                      const Color& color,
+                                     const FootprintCache& footprint_cache,
+                                     ScoringMode scoring_mode,
+                                     const std::vector<std::unique_ptr<FootprintCache>>& pyramid_footprint_caches,
+                                     PyramidSettings pyramid_settings,
                                      ThreadPool& thread_pool)
     : target(full_img.get_w(), full_img.get_h())
     , current(full_img.get_w(), full_img.get_h())
+    , residual(full_img.get_w(), full_img.get_h() + 1) // padding row for the vector scoring kernels
     , nail_positions(nail_positions)
     , nail_radius(nail_radius)
     , string_radius(string_radius)
     , color{ color }
+    , footprint_cache{ footprint_cache }
+    , scoring_mode{ scoring_mode }
+    , pyramid_settings{ pyramid_settings }
     , thread_pool{ thread_pool }
+    , pruned_candidates{ 0 }
+    , scanned_candidates{ 0 }
 {
+    assert(scoring_mode != ScoringMode::AUTO);
     constexpr double max_dist = Vec3<double>{ 1.0, 1.0, 1.0 }.len();
-    std::transform(full_img.cbegin(), full_img.cend(), target.begin(), [&color, &background_color](const auto c) {
-        return std::clamp(std::pow(c->dist(background_color) / max_dist, 0.8) *
-                              (1.0 - std::pow(c->dist(color) / max_dist, 0.4)),
-                          0.0,
-                          1.0) *
-               std::numeric_limits<StringSolver::pixel_t>::max();
+    std::array<std::vector<float>, Color::CHANNELS> rows;
+    for (std::vector<float>& row : rows) {
+        row.resize(full_img.get_w());
+    }
+    for (size_t y{ 0 }; y < full_img.get_h(); ++y) {
+        for (size_t c{ 0 }; c < Color::CHANNELS; ++c) {
+            full_img.load_row(c, y, rows[c].data());
+        }
+        for (size_t x{ 0 }; x < full_img.get_w(); ++x) {
+            const Color c{ rows[0][x], rows[1][x], rows[2][x], rows[3][x] };
+            target(x, y) = std::clamp(std::pow(c.dist(background_color) / max_dist, 0.8) *
+                                          (1.0 - std::pow(c.dist(color) / max_dist, 0.4)),
+                                      0.0,
+                                      1.0) *
+                           std::numeric_limits<StringSolver::pixel_t>::max();
+        }
+    }
+    std::transform(target.cbegin(), target.cend(), current.cbegin(), residual.begin(), [](const auto t, const auto c) {
+        return StringSolver::make_residual(*t, *c);
     });
+
+    pyramid.reserve(pyramid_footprint_caches.size());
+    for (size_t level_id{ 0 }; level_id < pyramid_footprint_caches.size(); ++level_id) {
+        const FootprintCache& level_footprint_cache{ *pyramid_footprint_caches[level_id] };
+        const size_t w{ level_footprint_cache.get_w() };
+        const size_t h{ level_footprint_cache.get_h() };
+        PyramidLevel& level{ pyramid.emplace_back(level_footprint_cache,
+                                                  size_t{ 2 } << level_id,
+                                                  Array2d<StringSolver::pixel_t>(w, h),
+                                                  Array2d<StringSolver::pixel_t>(w, h),
+                                                  Array2d<StringSolver::residual_t>(w, h + 1)) };
+        for (size_t y{ 0 }; y < h; ++y) {
+            for (size_t x{ 0 }; x < w; ++x) {
+                level.target(x, y) = block_average(target, level.factor, x, y);
+                level.current(x, y) = block_average(current, level.factor, x, y);
+                level.residual(x, y) = StringSolver::make_residual(level.target(x, y), level.current(x, y));
+            }
+        }
+    }
 }
 
 void StringColorSolver::solve()
 {
     sequence = std::make_unique<std::vector<StringLine>>();
+    if (scoring_mode == ScoringMode::INCREMENTAL) {
+        gain_tracker = std::make_unique<ChordGainTracker>(footprint_cache, target, current, thread_pool);
+    } else {
+        chord_bounds.assign(footprint_cache.get_chord_count(), std::numeric_limits<double>::lowest());
+        cell_residual_max.assign(footprint_cache.get_coarse_w() * footprint_cache.get_coarse_h(), 0);
+        for (size_t y{ 0 }; y < target.get_h(); ++y) {
+            for (size_t x{ 0 }; x < target.get_w(); ++x) {
+                const size_t cell{ (x / FootprintCache::COARSE_CELL_SIZE) +
+                                   (y / FootprintCache::COARSE_CELL_SIZE * footprint_cache.get_coarse_w()) };
+                cell_residual_max[cell] =
+                    std::max(cell_residual_max[cell], static_cast<int32_t>(target(x, y)) - current(x, y));
+            }
+        }
+    }
     int max_iterations{ 1000 };
-    for (int i = 0; i < max_iterations; ++i) {
-        double mse_delta = solve_step();
+    bool converged{ false };
+    for (int i = 0; i < max_iterations && !converged; ++i) {
+        double mse_delta = gain_tracker ? solve_step_incremental() : solve_step();
         Logger::debug("MSE delta: {}", mse_delta);
-        if (mse_delta > -0.001) {
-            return;
+        converged = mse_delta > -0.001;
+    }
+    if (!converged) {
+        Logger::warn("StringColorSolver: max iterations reached: {}", max_iterations);
+    }
+    if (!gain_tracker) {
+        const size_t total{ pruned_candidates + scanned_candidates };
+        Logger::info("Pruned {} of {} candidate scans ({:.1f}%)",
+                     pruned_candidates,
+                     total,
+                     total > 0 ? 100.0 * static_cast<double>(pruned_candidates) / static_cast<double>(total) : 0.0);
+    }
+}
+
+double StringColorSolver::solve_step_incremental()
+{
+    nail_id_t last_nail_id{ sequence->empty() ? 0 : sequence->back().get_end_nail_id() };
+    StringLine::Wrap last_wrap{ sequence->empty() ? StringLine::Wrap::CLOKWISE : sequence->back().get_end_wrap() };
+
+    std::optional<StringLine> best_string_line;
+    double best_mse_delta{ std::numeric_limits<double>::max() };
+    for (nail_id_t next_nail_id{ 0 }; next_nail_id < nail_positions.size(); ++next_nail_id) {
+        if (next_nail_id == last_nail_id) {
+            continue;
         }
+        for (auto next_wrap : { StringLine::Wrap::CLOKWISE, StringLine::Wrap::ANTICLOCKWISE }) {
+            StringLine string_line{
+                nail_positions, nail_radius, string_radius, last_nail_id, last_wrap, next_nail_id, next_wrap
+            };
+            double mse_delta{ std::numeric_limits<double>::max() };
+            if (string_line.get_length() >= StringSolver::min_string_length) {
+                mse_delta = static_cast<double>(gain_tracker->get_gain(footprint_cache.get_chord_id(string_line)));
+            }
+            if (!best_string_line || mse_delta < best_mse_delta) {
+                best_string_line.emplace(string_line);
+                best_mse_delta = mse_delta;
+            }
+        }
+    }
+
+    sequence->push_back(best_string_line.value());
+    const FootprintCache::chord_id_t best_chord_id{ footprint_cache.get_chord_id(best_string_line.value()) };
+    gain_tracker->draw(best_chord_id, current);
+    for (const uint32_t p : footprint_cache.get(best_chord_id).pixels) {
+        residual.data()[p] = StringSolver::make_residual(target.data()[p], current.data()[p]);
     }
-    Logger::warn("StringColorSolver: max iterations reached: {}", max_iterations);
+
+    return best_mse_delta;
 }
 
 double StringColorSolver::solve_step()
@@ -55,43 +181,203 @@ double StringColorSolver::solve_step()
     nail_id_t last_nail_id{ sequence->empty() ? 0 : sequence->back().get_end_nail_id() };
     StringLine::Wrap last_wrap{ sequence->empty() ? StringLine::Wrap::CLOKWISE : sequence->back().get_end_wrap() };
 
-    std::function<StringSolver(nail_id_t, StringLine::Wrap)> f =
-        [this, last_nail_id, last_wrap](nail_id_t next_nail_id, StringLine::Wrap next_wrap) {
-            StringSolver solver{
-                target,
-                current,
-                string_radius,
-                StringLine(nail_positions, nail_radius, string_radius, last_nail_id, last_wrap, next_nail_id, next_wrap)
-            };
+    std::vector<size_t> candidates;
+    if (pyramid.empty()) {
+        candidates.resize(2 * (nail_positions.size() - 1));
+        std::iota(candidates.begin(), candidates.end(), 0);
+    } else {
+        candidates = shortlist_candidates(last_nail_id, last_wrap);
+    }
+    const size_t candidate_count{ candidates.size() };
+
+    // candidates are scanned in order of their cached bounds and skipped once the bound can no longer beat the best
+    // found so far, by this task or any other. Ties go to the lower candidate index, as in an unpruned scan
+    using Score = std::pair<double, size_t>;
+    std::atomic<double> shared_best{ std::numeric_limits<double>::max() };
+    std::atomic<size_t> pruned{ 0 };
+    auto scan = [this, last_nail_id, last_wrap, &candidates, &shared_best, &pruned](size_t begin, size_t end) {
+        std::vector<FootprintCache::chord_id_t> chord_ids(end - begin);
+        std::vector<double> bounds(end - begin);
+        for (size_t i{ begin }; i < end; ++i) {
+            const auto [next_nail_id, next_wrap]{ get_candidate_end(last_nail_id, candidates[i]) };
+            const FootprintCache::chord_id_t chord_id{ footprint_cache.get_stored_chord_id(
+                footprint_cache.get_chord_id(last_nail_id, last_wrap, next_nail_id, next_wrap)) };
+            chord_ids[i - begin] = chord_id;
+            bounds[i - begin] = std::max(chord_bounds[chord_id], get_coarse_bound(chord_id));
+        }
+        std::vector<size_t> order(end - begin);
+        std::iota(order.begin(), order.end(), begin);
+        std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+            return bounds[lhs - begin] < bounds[rhs - begin];
+        });
+
+        Score best{ std::numeric_limits<double>::max(), candidates[begin] };
+        size_t task_pruned{ 0 };
+        for (const size_t i : order) {
+            const size_t candidate{ candidates[i] };
+            const double bound{ bounds[i - begin] };
+            if (bound > shared_best.load(std::memory_order_relaxed) || Score{ bound, candidate } > best) {
+                ++task_pruned;
+                continue;
+            }
+            StringSolver solver{ make_candidate_solver(last_nail_id, last_wrap, candidate) };
             solver.solve();
-            return solver;
+            chord_bounds[chord_ids[i - begin]] = solver.get_mse_delta_bound();
+            const Score score{ solver.get_mse_delta(), candidate };
+            if (score < best) {
+                best = score;
+                double expected{ shared_best.load(std::memory_order_relaxed) };
+                while (best.first < expected && !shared_best.compare_exchange_weak(expected, best.first)) {
+                }
+            }
+        }
+        pruned += task_pruned;
+        return best;
+    };
+    const Score best{ thread_pool.parallel_reduce(
+        0,
+        candidate_count,
+        0,
+        Score{ std::numeric_limits<double>::max(), candidates.front() },
+        scan,
+        [](const Score& lhs, const Score& rhs) { return std::min(lhs, rhs); }) };
+    pruned_candidates += pruned;
+    scanned_candidates += candidate_count - pruned;
+    Logger::debug("Pruned candidates: {}/{}", pruned.load(), candidate_count);
+
+    StringSolver best_solver{ make_candidate_solver(last_nail_id, last_wrap, best.second) };
+    sequence->push_back(best_solver.get_string_line());
+    best_solver.draw();
+    update_cell_residual_max(footprint_cache.get(best_solver.get_string_line()));
+    update_pyramid(footprint_cache.get(best_solver.get_string_line()));
+
+    return best.first;
+}
+
+// scores the candidates from the coarsest level down, keeping shortlist_size << level_id of them at each level
+std::vector<size_t> StringColorSolver::shortlist_candidates(nail_id_t last_nail_id, StringLine::Wrap last_wrap)
+{
+    const size_t shortlist_size{ sequence->size() < pyramid_settings.coarse_steps ? 1
+                                                                                   : pyramid_settings.shortlist_size };
+    const size_t candidate_count{ 2 * (nail_positions.size() - 1) };
+
+    std::vector<size_t> candidates;
+    candidates.reserve(candidate_count);
+    for (size_t candidate{ 0 }; candidate < candidate_count; ++candidate) {
+        const auto [next_nail_id, next_wrap]{ get_candidate_end(last_nail_id, candidate) };
+        const StringLine string_line{
+            nail_positions, nail_radius, string_radius, last_nail_id, last_wrap, next_nail_id, next_wrap
         };
+        if (string_line.get_length() >= StringSolver::min_string_length) {
+            candidates.push_back(candidate);
+        }
+    }
+    if (candidates.empty()) {
+        candidates.push_back(0);
+    }
 
-    std::vector<std::future<StringSolver>> futures;
-    futures.reserve(2 * (nail_positions.size() - 1));
-    for (nail_id_t next_nail_id{ 0 }; next_nail_id < nail_positions.size(); ++next_nail_id) {
-        if (next_nail_id == last_nail_id) {
+    using Score = std::pair<int64_t, size_t>;
+    for (size_t level_id{ pyramid.size() }; level_id-- > 0;) {
+        const size_t keep{ shortlist_size << level_id };
+        if (candidates.size() <= keep) {
             continue;
         }
-        for (auto next_wrap : { StringLine::Wrap::CLOKWISE, StringLine::Wrap::ANTICLOCKWISE }) {
-            futures.push_back(std::move(thread_pool.submit(1, f, next_nail_id, next_wrap)));
+        const PyramidLevel& level{ pyramid[level_id] };
+        std::vector<Score> scores(candidates.size());
+        thread_pool.parallel_for(0, candidates.size(), 0, [&, last_nail_id, last_wrap](size_t begin, size_t end) {
+            for (size_t i{ begin }; i < end; ++i) {
+                const auto [next_nail_id, next_wrap]{ get_candidate_end(last_nail_id, candidates[i]) };
+                const FootprintCache::Footprint footprint{ level.footprint_cache.get(
+                    level.footprint_cache.get_chord_id(last_nail_id, last_wrap, next_nail_id, next_wrap)) };
+                scores[i] = { footprint_mse_delta(footprint, level.residual.data()).delta, candidates[i] };
+            }
+        });
+
+        std::partial_sort(scores.begin(), scores.begin() + static_cast<std::ptrdiff_t>(keep), scores.end());
+        candidates.resize(keep);
+        for (size_t i{ 0 }; i < keep; ++i) {
+            candidates[i] = scores[i].second;
         }
+        std::sort(candidates.begin(), candidates.end());
     }
+    return candidates;
+}
 
-    std::vector<StringSolver> solvers;
-    solvers.reserve(futures.size());
-    for (auto& f : futures) {
-        solvers.push_back(f.get());
+void StringColorSolver::update_pyramid(const FootprintCache::Footprint& footprint)
+{
+    for (PyramidLevel& level : pyramid) {
+        std::optional<uint32_t> last_pixel;
+        for (const uint32_t p : footprint.pixels) {
+            const size_t x{ p % target.get_w() / level.factor };
+            const size_t y{ p / target.get_w() / level.factor };
+            const auto level_pixel{ static_cast<uint32_t>(x + (y * level.current.get_w())) };
+            if (level_pixel == last_pixel) {
+                continue;
+            }
+            last_pixel = level_pixel;
+            level.current(x, y) = block_average(current, level.factor, x, y);
+            level.residual(x, y) = StringSolver::make_residual(level.target(x, y), level.current(x, y));
+        }
     }
+}
 
-    auto best_solver = std::min_element(std::begin(solvers), std::end(solvers), [](const auto& a, const auto& b) {
-        return a.get_mse_delta() < b.get_mse_delta();
-    });
+void StringColorSolver::update_cell_residual_max(const FootprintCache::Footprint& footprint)
+{
+    const size_t w{ target.get_w() };
+    const size_t h{ target.get_h() };
+    const size_t coarse_w{ footprint_cache.get_coarse_w() };
+    constexpr size_t cell_size{ FootprintCache::COARSE_CELL_SIZE };
+    std::optional<size_t> last_cell;
+    for (const uint32_t p : footprint.pixels) {
+        const size_t cell_x{ p % w / cell_size };
+        const size_t cell_y{ p / w / cell_size };
+        const size_t cell{ cell_x + (cell_y * coarse_w) };
+        if (cell == last_cell) {
+            continue;
+        }
+        last_cell = cell;
+        int32_t residual_max{ 0 };
+        for (size_t y{ cell_y * cell_size }; y < std::min(h, (cell_y + 1) * cell_size); ++y) {
+            for (size_t x{ cell_x * cell_size }; x < std::min(w, (cell_x + 1) * cell_size); ++x) {
+                residual_max = std::max(residual_max, static_cast<int32_t>(target(x, y)) - current(x, y));
+            }
+        }
+        cell_residual_max[cell] = residual_max;
+    }
+}
+
+// a pixel with residual r gains at most min(2sr, r^2) from a draw of intensity s, now or after any later draws
+double StringColorSolver::get_coarse_bound(FootprintCache::chord_id_t chord_id) const
+{
+    int64_t gain{ 0 };
+    for (const FootprintCache::CoarseCell& cell : footprint_cache.get_coarse_cells(chord_id)) {
+        const int64_t r{ cell_residual_max[cell.cell] };
+        gain += std::min(2 * cell.intensity_sum * r, cell.pixel_count * r * r);
+    }
+    return -static_cast<double>(gain);
+}
 
-    sequence->push_back(best_solver->get_string_line());
-    best_solver->draw();
+std::pair<nail_id_t, StringLine::Wrap> StringColorSolver::get_candidate_end(nail_id_t last_nail_id,
+                                                                            size_t candidate) const
+{
+    const nail_id_t next_nail_id{ static_cast<nail_id_t>(candidate / 2) < last_nail_id
+                                      ? static_cast<nail_id_t>(candidate / 2)
+                                      : static_cast<nail_id_t>(candidate / 2) + 1 };
+    const StringLine::Wrap next_wrap{ candidate % 2 == 0 ? StringLine::Wrap::CLOKWISE
+                                                         : StringLine::Wrap::ANTICLOCKWISE };
+    return { next_nail_id, next_wrap };
+}
 
-    return best_solver->get_mse_delta();
+StringSolver StringColorSolver::make_candidate_solver(nail_id_t last_nail_id,
+                                                      StringLine::Wrap last_wrap,
+                                                      size_t candidate)
+{
+    const auto [next_nail_id, next_wrap]{ get_candidate_end(last_nail_id, candidate) };
+    return { target,
+             current,
+             residual,
+             footprint_cache.get(footprint_cache.get_chord_id(last_nail_id, last_wrap, next_nail_id, next_wrap)),
+             StringLine(nail_positions, nail_radius, string_radius, last_nail_id, last_wrap, next_nail_id, next_wrap) };
 }
 
 std::unique_ptr<std::vector<StringLine>> StringColorSolver::get_sequence()
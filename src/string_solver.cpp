@@ -1,56 +1,60 @@
 #include "string_solver.h"
-#include "line.h"
+#include "mse_kernel.h"
+#include <algorithm>
 #include <cstdint>
 #include <limits>
 
 StringSolver::StringSolver(const Array2d<pixel_t>& target,
                            Array2d<pixel_t>& current,
-                           const double string_radius,
+                           Array2d<residual_t>& residual,
+                           const FootprintCache::Footprint footprint,
                            const StringLine&& string_line)
     : target(target)
     , current(current)
-    , string_radius(string_radius)
+    , residual(residual)
+    , footprint(footprint)
     , string_line(string_line)
     , mse_delta(std::nullopt)
+    , mse_delta_bound(std::nullopt)
 {
 }
 
 void StringSolver::solve()
 {
-    const double min_string_length{ 100.0 }; // TODO: make this a parameter
     if (string_line.get_length() < min_string_length) {
         mse_delta = std::numeric_limits<double>::max();
+        mse_delta_bound = std::numeric_limits<double>::max();
         return;
     }
 
-    double mse_delta_tmp{ 0.0 };
-    line(string_line.get_start_pos(), string_line.get_end_pos(), string_radius, [&](int32_t x, int32_t y, double d) {
-        if (target.is_in(x, y)) {
-            mse_delta_tmp +=
-                std::pow(std::min(static_cast<int32_t>(std::numeric_limits<pixel_t>::max()),
-                                  static_cast<int32_t>(string_function(d)) + static_cast<int32_t>(current(x, y))) -
-                             static_cast<int32_t>(target(x, y)),
-                         2) -
-                std::pow(static_cast<int32_t>(current(x, y)) - static_cast<int32_t>(target(x, y)), 2);
-        }
-    });
-    mse_delta = mse_delta_tmp;
+    const MseDelta mse_delta_tmp{ footprint_mse_delta(footprint, residual.data()) };
+    mse_delta = static_cast<double>(mse_delta_tmp.delta);
+    mse_delta_bound = static_cast<double>(mse_delta_tmp.lower_bound);
 }
 
 void StringSolver::draw()
 {
-    line(string_line.get_start_pos(), string_line.get_end_pos(), string_radius, [&](int32_t x, int32_t y, double d) {
-        if (current.is_in(x, y)) {
-            current(x, y) = std::min(static_cast<int32_t>(std::numeric_limits<pixel_t>::max()),
-                                     static_cast<int32_t>(string_function(d)) + static_cast<int32_t>(current(x, y)));
-        }
-    });
+    const pixel_t* target_data{ target.data() };
+    pixel_t* current_data{ current.data() };
+    residual_t* residual_data{ residual.data() };
+    for (size_t i{ 0 }; i < footprint.pixels.size(); ++i) {
+        const uint32_t p{ footprint.pixels[i] };
+        current_data[p] =
+            std::min(static_cast<int32_t>(std::numeric_limits<pixel_t>::max()),
+                     static_cast<int32_t>(footprint.intensities[i]) + static_cast<int32_t>(current_data[p]));
+        residual_data[p] = make_residual(target_data[p], current_data[p]);
+    }
 }
 
-StringSolver::pixel_t StringSolver::string_function(double d) const
+StringSolver::residual_t StringSolver::make_residual(pixel_t target, pixel_t current)
 {
-    return static_cast<pixel_t>((1.0 - std::fmin(1.0, d * d / string_radius)) * 0.30 *
-                                std::numeric_limits<pixel_t>::max());
+    static_assert(std::numeric_limits<pixel_t>::max() << RESIDUAL_HEADROOM_BITS <=
+                  std::numeric_limits<residual_t>::max());
+    const int32_t headroom{ std::min(static_cast<int32_t>(std::numeric_limits<pixel_t>::max() - current),
+                                     RESIDUAL_HEADROOM_MAX) };
+    return static_cast<residual_t>(((static_cast<int32_t>(target) - static_cast<int32_t>(current))
+                                    << RESIDUAL_HEADROOM_BITS) |
+                                   headroom);
 }
 
 StringLine StringSolver::get_string_line() const
@@ -62,3 +66,8 @@ double StringSolver::get_mse_delta() const
 {
     return mse_delta.value();
 }
+
+double StringSolver::get_mse_delta_bound() const
+{
+    return mse_delta_bound.value();
+}
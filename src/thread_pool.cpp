@@ -1,13 +1,101 @@
 #include "thread_pool.h"
+#include <algorithm>
+#include <new>
+#include <random>
 #include <stop_token>
 
+namespace {
+// worker of the pool the current thread belongs to, tasks it submits go to its own deques
+thread_local const ThreadPool* current_pool{ nullptr };
+thread_local size_t current_worker_id{ 0 };
+thread_local std::minstd_rand victim_rng{ 1 };
+
+// Task blocks are usually freed by a different thread than the one that allocated them,
+// so thread caches hand surplus blocks to a shared depot and refill from it a batch at a time
+constexpr size_t TASK_BLOCK_BATCH{ 64 };
+
+struct TaskBlockDepot
+{
+    std::mutex mutex;
+    std::vector<std::vector<void*>> batches;
+
+    ~TaskBlockDepot()
+    {
+        for (const auto& batch : batches) {
+            for (void* block : batch) {
+                ::operator delete(block);
+            }
+        }
+    }
+};
+
+TaskBlockDepot& get_task_block_depot()
+{
+    static TaskBlockDepot depot;
+    return depot;
+}
+
+struct TaskBlockCache
+{
+    std::vector<void*> blocks;
+
+    ~TaskBlockCache()
+    {
+        if (blocks.empty()) {
+            return;
+        }
+        TaskBlockDepot& depot{ get_task_block_depot() };
+        std::unique_lock<std::mutex> lock(depot.mutex);
+        depot.batches.push_back(std::move(blocks));
+    }
+};
+
+thread_local TaskBlockCache task_block_cache;
+
+void* allocate_task_block(size_t block_size)
+{
+    std::vector<void*>& blocks{ task_block_cache.blocks };
+    if (blocks.empty()) {
+        TaskBlockDepot& depot{ get_task_block_depot() };
+        std::unique_lock<std::mutex> lock(depot.mutex);
+        if (!depot.batches.empty()) {
+            blocks.swap(depot.batches.back());
+            depot.batches.pop_back();
+        }
+    }
+    if (blocks.empty()) {
+        return ::operator new(block_size);
+    }
+    void* block{ blocks.back() };
+    blocks.pop_back();
+    return block;
+}
+
+void free_task_block(void* block)
+{
+    std::vector<void*>& blocks{ task_block_cache.blocks };
+    if (blocks.size() >= 2 * TASK_BLOCK_BATCH) {
+        std::vector<void*> batch(blocks.end() - TASK_BLOCK_BATCH, blocks.end());
+        blocks.resize(blocks.size() - TASK_BLOCK_BATCH);
+        TaskBlockDepot& depot{ get_task_block_depot() };
+        std::unique_lock<std::mutex> lock(depot.mutex);
+        depot.batches.push_back(std::move(batch));
+    }
+    blocks.push_back(block);
+}
+}
+
 // ThreadPool
 ThreadPool::ThreadPool(unsigned int n_threads)
-    : tasks([](const std::unique_ptr<AbstractTask>& a, const std::unique_ptr<AbstractTask>& b) { return *a < *b; })
+    : queued_tasks{ 0 }
+    , next_worker{ 0 }
+    , sleeping_threads{ 0 }
 {
-    std::unique_lock<std::mutex> lock(tasks_mutex);
+    for (unsigned int i = 0; i < std::max(n_threads, 1U); i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
     for (unsigned int i = 0; i < n_threads; i++) {
-        threads.emplace_back([this](std::stop_token stop_token) { thread_loop(std::move(stop_token)); });
+        threads.emplace_back([this, i](std::stop_token stop_token) { thread_loop(std::move(stop_token), i); });
     }
 }
 
@@ -16,7 +104,10 @@ ThreadPool::~ThreadPool()
     for (auto& t : threads) {
         t.request_stop();
     }
-    tasks_cv.notify_all();
+    {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+    }
+    sleep_cv.notify_all();
     for (auto& thread : threads) {
         if (thread.joinable()) {
             thread.join();
@@ -29,19 +120,132 @@ unsigned int ThreadPool::get_n_threads() const
     return static_cast<unsigned int>(threads.size());
 }
 
-void ThreadPool::thread_loop(std::stop_token stop_token)
+void ThreadPool::push(TaskPtr task)
 {
-    while (!stop_token.stop_requested()) {
-        std::unique_ptr<AbstractTask> t;
+    const size_t worker_id{ is_worker_thread() ? current_worker_id : next_worker++ % workers.size() };
+    Worker& worker{ *workers[worker_id] };
+    {
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.queues[task->get_priority()].push_back(std::move(task));
+        queued_tasks++;
+    }
+
+    // a worker going to sleep counts itself before checking queued_tasks, so one of the two sides sees the other
+    if (sleeping_threads > 0) {
         {
-            std::unique_lock<std::mutex> lock(tasks_mutex);
-            tasks_cv.wait(lock, [this, &stop_token] { return stop_token.stop_requested() || !tasks.empty(); });
-            if (stop_token.stop_requested() || tasks.empty()) {
-                continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+        }
+        sleep_cv.notify_one();
+    }
+}
+
+ThreadPool::TaskPtr ThreadPool::pop(size_t worker_id, int min_priority)
+{
+    Worker& worker{ *workers[worker_id] };
+    std::unique_lock<std::mutex> lock(worker.mutex);
+    for (auto& [priority, queue] : worker.queues) {
+        if (priority < min_priority) {
+            break;
+        }
+        if (!queue.empty()) {
+            TaskPtr task{ std::move(queue.back()) };
+            queue.pop_back();
+            queued_tasks--;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+ThreadPool::TaskPtr ThreadPool::steal(size_t thief_id, int min_priority)
+{
+    const size_t first_victim{ std::uniform_int_distribution<size_t>{ 0, workers.size() - 1 }(victim_rng) };
+    for (size_t i{ 0 }; i < workers.size(); ++i) {
+        const size_t victim_id{ (first_victim + i) % workers.size() };
+        if (victim_id == thief_id) {
+            continue;
+        }
+        Worker& victim{ *workers[victim_id] };
+        std::unique_lock<std::mutex> lock(victim.mutex);
+        for (auto& [priority, queue] : victim.queues) {
+            if (priority < min_priority) {
+                break;
+            }
+            if (!queue.empty()) {
+                TaskPtr task{ std::move(queue.front()) };
+                queue.pop_front();
+                queued_tasks--;
+                return task;
             }
-            t = std::move(tasks.top_pop());
         }
-        t->run();
+    }
+    return nullptr;
+}
+
+size_t ThreadPool::get_chunk_size(size_t n, size_t grain) const
+{
+    if (grain > 0) {
+        return grain;
+    }
+    const size_t n_chunks{ std::max<size_t>(threads.size(), 1) * CHUNKS_PER_THREAD };
+    return std::max<size_t>((n + n_chunks - 1) / n_chunks, 1);
+}
+
+void ThreadPool::run_chunked(size_t begin,
+                             size_t end,
+                             size_t chunk_size,
+                             ChunkedJob::ChunkFunc func,
+                             void* context,
+                             int priority)
+{
+    if (begin >= end) {
+        return;
+    }
+    auto job{ std::make_shared<ChunkedJob>(begin, end, chunk_size, func, context) };
+    const size_t n_helpers{ std::min(job->get_chunk_count() - 1, threads.size()) };
+    for (size_t i{ 0 }; i < n_helpers; ++i) {
+        push(TaskPtr{ new ChunkedJobTask(priority, job) });
+    }
+    job->run_chunks();
+    while (!job->is_done()) {
+        if (!is_worker_thread() || !run_pending_task(priority)) {
+            job->wait_for_progress();
+        }
+    }
+    job->rethrow_exception();
+}
+
+bool ThreadPool::is_worker_thread() const
+{
+    return current_pool == this;
+}
+
+bool ThreadPool::run_pending_task(int min_priority)
+{
+    TaskPtr t{ pop(current_worker_id, min_priority) };
+    if (!t) {
+        t = steal(current_worker_id, min_priority);
+    }
+    if (!t) {
+        return false;
+    }
+    t->run();
+    return true;
+}
+
+void ThreadPool::thread_loop(std::stop_token stop_token, size_t worker_id)
+{
+    current_pool = this;
+    current_worker_id = worker_id;
+    victim_rng.seed(static_cast<std::minstd_rand::result_type>(worker_id + 1));
+    while (!stop_token.stop_requested()) {
+        if (run_pending_task()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping_threads++;
+        sleep_cv.wait(lock, [this, &stop_token] { return stop_token.stop_requested() || queued_tasks > 0; });
+        sleeping_threads--;
     }
 }
 // ThreadPool
@@ -52,8 +256,94 @@ ThreadPool::AbstractTask::AbstractTask(int priority)
 {
 }
 
-bool ThreadPool::AbstractTask::operator<(const AbstractTask& other) const
+void ThreadPool::AbstractTask::release()
+{
+    delete this;
+}
+
+void* ThreadPool::AbstractTask::operator new(size_t size)
+{
+    if (size > BLOCK_SIZE) {
+        return ::operator new(size);
+    }
+    return allocate_task_block(BLOCK_SIZE);
+}
+
+void ThreadPool::AbstractTask::operator delete(void* p, size_t size)
+{
+    if (size > BLOCK_SIZE) {
+        ::operator delete(p);
+        return;
+    }
+    free_task_block(p);
+}
+// ThreadPool::AbstractTask
+
+// ThreadPool::ChunkedJob
+ThreadPool::ChunkedJob::ChunkedJob(size_t begin, size_t end, size_t chunk_size, ChunkFunc func, void* context)
+    : begin{ begin }
+    , end{ end }
+    , chunk_size{ chunk_size }
+    , chunk_count{ (end - begin + chunk_size - 1) / chunk_size }
+    , func{ func }
+    , context{ context }
+    , next_chunk{ 0 }
+    , remaining_chunks{ chunk_count }
+{
+}
+
+void ThreadPool::ChunkedJob::run_chunks()
+{
+    for (size_t chunk_id{ next_chunk++ }; chunk_id < chunk_count; chunk_id = next_chunk++) {
+        const size_t chunk_begin{ begin + (chunk_id * chunk_size) };
+        try {
+            func(context, chunk_id, chunk_begin, std::min(end, chunk_begin + chunk_size));
+        } catch (...) {
+            if (!failed.test_and_set()) {
+                exception = std::current_exception();
+            }
+        }
+        if (--remaining_chunks == 0) {
+            remaining_chunks.notify_all();
+        }
+    }
+}
+
+bool ThreadPool::ChunkedJob::is_done() const
+{
+    return remaining_chunks == 0;
+}
+
+void ThreadPool::ChunkedJob::wait_for_progress() const
+{
+    const size_t remaining{ remaining_chunks };
+    if (remaining > 0) {
+        remaining_chunks.wait(remaining);
+    }
+}
+
+void ThreadPool::ChunkedJob::rethrow_exception() const
+{
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+size_t ThreadPool::ChunkedJob::get_chunk_count() const
+{
+    return chunk_count;
+}
+// ThreadPool::ChunkedJob
+
+// ThreadPool::ChunkedJobTask
+ThreadPool::ChunkedJobTask::ChunkedJobTask(int priority, std::shared_ptr<ChunkedJob> job)
+    : AbstractTask(priority)
+    , job{ std::move(job) }
+{
+}
+
+void ThreadPool::ChunkedJobTask::run()
 {
-    return priority < other.priority;
+    job->run_chunks();
 }
-// ThreadPool::AbstractTask
\ No newline at end of file
+// ThreadPool::ChunkedJobTask